@@ -1,7 +1,15 @@
 /**
  * @file asyncLoop.hpp
  * @author qc
- * @brief 将定时器循环和io事件循环结合起来
+ * @brief 将就绪队列,定时器循环和io事件循环结合起来,单线程下只要一个run()就能驱动所有协程
+ * @details 每一轮tryRun:
+ *          1. 执行就绪队列中的协程(Loop)
+ *          2. 执行所有到期的定时器(TimerLoop),得到下一个定时器还有多久到期
+ *          3. epoll_wait(IoLoop)等fd事件,超时时间就是下一个定时器的到期时间,就绪队列不空就不等
+ *          4. 等完之后再执行一次到期的定时器
+ *          没有fd在等的时候也是阻塞在epoll_wait上,不再用std::this_thread::sleep_for
+ *          定义了CO_ASYNC_USE_IO_URING的时候还带一个IoUringLoop, ring fd挂在同一个epoll上,
+ *          3之前提交SQE, 3之后取CQE
  * @version 0.1
  * @date 2024-07-30
  * 
@@ -11,23 +19,83 @@
 
 #pragma once
 
+#include <iostream>
+#include <exception>
+#include <memory_resource>
+#include <utility>
+#include "scheduler.hpp"
 #include "ioLoop.hpp"
 #include "timerLoop.hpp"
-#include <thread>
+#include "uringLoop.hpp"
 
 namespace co_async {
 
 struct AsyncLoop {
+    // 定时器很多(比如每个连接一个空闲超时)的时候用TimerBackend::Wheel
+    // 构造之后这个线程上不带loop的sleep_for/sleep_until(getTimerLoop())都用这个loop的定时器
+    explicit AsyncLoop(TimerBackend timerBackend = TimerBackend::RbTree)
+        : mTimerLoop(timerBackend), mPreviousTimerLoop(std::exchange(currentTimerLoop(), &mTimerLoop)) {
+        mIoLoop.setTimerLoop(mTimerLoop);
+        // 别的线程取消了这里的定时器, 把阻塞在epoll_wait里的loop叫醒
+        mTimerLoop.setWakeup(&mIoLoop, [](void *ioLoop) {
+            static_cast<IoLoop *>(ioLoop)->wakeup();
+        });
+#if CO_ASYNC_USE_IO_URING
+        // 有完成事件的时候ring fd可读, 把epoll_wait叫醒
+        mIoLoop.addWakeSource(mUringLoop.ringFd());
+#endif
+    }
 
-    void process() {
-        while (1) {
-            auto timeout = mTimerLoop.getNext();
-            if (mIoLoop.hasEvent()) 
-                mIoLoop.tryRun(timeout);
-            else if (timeout) {
-                std::this_thread::sleep_for(*timeout);
-            } else break;
+    AsyncLoop(AsyncLoop &&) = delete;
+
+    ~AsyncLoop() {
+        if (currentTimerLoop() == &mTimerLoop) currentTimerLoop() = mPreviousTimerLoop;
+    }
+
+    void addTask(std::coroutine_handle<> task) {
+        mReadyLoop.addTask(task);
+    }
+
+    // 就绪队列,定时器,fd上都没有协程了就返回false
+    bool tryRun() {
+        // 同一个线程上有好几个AsyncLoop的时候, 正在跑的协程用的是正在跑的这个
+        CurrentTimerLoopScope scope(mTimerLoop);
+        mReadyLoop.runOnce();
+        auto timeout = mTimerLoop.run();
+#if CO_ASYNC_USE_IO_URING
+        // 攒下来的SQE先提交, 完成事件和fd事件一起在epoll_wait里等
+        mUringLoop.submit();
+#endif
+        if (mReadyLoop.hasTask()) {
+            timeout = TimerLoop::Clock::duration::zero();
+        } else if (!timeout && !hasIoEvent()) {
+            return false;
         }
+        mIoLoop.tryRun(timeout);
+#if CO_ASYNC_USE_IO_URING
+        mUringLoop.reap();
+#endif
+        mTimerLoop.run();
+        return true;
+    }
+
+    bool hasIoEvent() const noexcept {
+#if CO_ASYNC_USE_IO_URING
+        if (mUringLoop.hasEvent()) return true;
+#endif
+        return mIoLoop.hasEvent();
+    }
+
+    void process() {
+        while (tryRun());
+    }
+
+    void run() {
+        process();
+    }
+
+    operator Loop &() {
+        return mReadyLoop;
     }
 
     operator TimerLoop &() {
@@ -38,10 +106,94 @@ struct AsyncLoop {
         return mIoLoop;
     }
 
+#if CO_ASYNC_USE_IO_URING
+    // DefaultIoLoop是IoUringLoop的时候, 流类型直接用AsyncLoop构造
+    operator IoUringLoop &() {
+        return mUringLoop;
+    }
+#endif
+
 private:
+    Loop mReadyLoop;
     IoLoop mIoLoop;
     TimerLoop mTimerLoop;
+    TimerLoop *mPreviousTimerLoop;
+#if CO_ASYNC_USE_IO_URING
+    IoUringLoop mUringLoop;
+#endif
+};
+
+// 分离的协程: 执行完自己销毁自己(final_suspend不挂起), 用来托管co_spawn出去的Task
+struct DetachedPromise : PooledFrame {
+    auto initial_suspend() noexcept { return enterArena(); }
+
+    // 不挂起直接销毁, 回到resume它的地方之前把当前arena清掉
+    struct FinalAwaiter : std::suspend_never {
+        void await_resume() const noexcept {
+            FrameArena::current() = nullptr;
+        }
+    };
+
+    auto final_suspend() noexcept { return FinalAwaiter(); }
+
+    // 没人等它,异常也没人接,打印出来之后丢掉,不能让一个连接把整个服务带走
+    void unhandled_exception() noexcept {
+        try {
+            throw;
+        } catch (std::exception const& e) {
+            std::cerr << "co_spawn: " << e.what() << std::endl;
+        } catch (...) {
+            std::cerr << "co_spawn: unknown exception" << std::endl;
+        }
+    }
+
+    void return_void() noexcept {}
+
+    auto get_return_object() {
+        return std::coroutine_handle<DetachedPromise>::from_promise(*this);
+    }
+
+    DetachedPromise &operator=(DetachedPromise &&) = delete;
+};
+
+struct DetachedTask {
+    using promise_type = DetachedPromise;
+
+    DetachedTask(std::coroutine_handle<promise_type> coroutine) noexcept : mCoroutine(coroutine) {}
+
+    std::coroutine_handle<promise_type> mCoroutine;
 };
 
+template <class T, class P>
+inline DetachedTask detachedHelper(Task<T, P> t) {
+    co_await t;
+}
+
+// arena是这个帧里的局部变量, t结束(final_suspend回到这里)之后整块释放
+template <class T, class P>
+inline DetachedTask detachedArenaHelper(Task<T, P> t, std::size_t arenaSize) {
+    std::pmr::monotonic_buffer_resource arena(arenaSize);
+    t.mCoroutine.promise().mArena = &arena;
+    co_await t;
+}
+
+// 把任务丢进loop的就绪队列后台执行,不等它的结果, 任务执行完帧自动释放
+// 在别的请求的arena里调用的时候, 托管用的帧不能分配在那个arena里(它可能比那个请求活得长)
+template <class T, class P>
+inline void co_spawn(AsyncLoop &loop, Task<T, P> &&t) {
+    FrameArena::Scope scope(nullptr);
+    loop.addTask(detachedHelper(std::move(t)).mCoroutine);
+}
+
+// 同上, 另外给t挂一个单调arena(第一块arenaSize字节): t里面创建的所有协程帧和流缓冲区都是bump分配, 释放什么也不做,
+// t结束的时候一次性还回去. 一个连接/一个请求一个任务的时候用, 请求路径上的帧不进malloc也不进FramePool
+// t自己的帧在调用co_spawn之前就分配好了, 不在arena里; t里面创建的东西不能活得比t长(比如再co_spawn出去的任务,
+// 要在FrameArena::Scope _(nullptr)里创建); arena不加锁, t的子任务不能跑到别的线程上(work_stealing)
+template <class T, class P>
+inline void co_spawn(AsyncLoop &loop, Task<T, P> &&t, std::size_t arenaSize) {
+    FrameArena::Scope scope(nullptr);
+    loop.addTask(detachedArenaHelper(std::move(t), arenaSize).mCoroutine);
+}
+
 
-}
\ No newline at end of file
+}
@@ -25,7 +25,7 @@ enum class OpenMode : int {
 
 inline Task<AsyncFile> open_fs_file(IoLoop &loop, std::filesystem::path path, OpenMode mode, mode_t access = 0644) {
     int oflags = (int)mode;
-    /* oflags |= O_NONBLOCK; */ // TODO: nonblockfsfilesviaiouring!
+    // 普通文件O_NONBLOCK没有意义, 真正的异步打开/读写见 uringLoop.hpp 中的 open_fs_file(IoUringLoop &, ...)
     int res = checkError(open(path.c_str(), oflags, access));
     AsyncFile file(res);
     co_return file;
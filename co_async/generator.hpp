@@ -15,14 +15,15 @@
 #include <exception>
 #include <utility>
 #include <utilities/uninitialized.hpp>
+#include <utilities/frame_allocator.hpp>
 #include "previous_awaiter.hpp"
 
 namespace co_async {
 
 template <class T>
-struct GeneratorPromise {
+struct GeneratorPromise : PooledFrame {
     auto initial_suspend() noexcept {
-        return std::suspend_always();
+        return enterArena();
     }
 
     auto final_suspend() noexcept {
@@ -75,9 +76,9 @@ struct GeneratorPromise {
 
 // 特化引用类型
 template <class T>
-struct GeneratorPromise<T &> {
+struct GeneratorPromise<T &> : PooledFrame {
     auto initial_suspend() noexcept {
-        return std::suspend_always();
+        return enterArena();
     }
 
     auto final_suspend() noexcept {
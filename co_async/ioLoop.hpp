@@ -19,14 +19,26 @@
 #include <sys/fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <cstdint>
 #include <source_location>
 #include <co_async/task.hpp>
 #include <co_async/timerLoop.hpp>
 #include <co_async/when_any.hpp>
 #include <co_async/when_all.hpp>
 #include <co_async/and_then.hpp>
+#include <utilities/mpsc_queue.hpp>
 #include <system_error>
 #include <span>
+#include <vector>
+#include <climits>
+#include <mutex>
+#include <atomic>
+#include <optional>
+#include <stop_token>
 #include <cerrno>
 #include <termios.h>
 
@@ -58,24 +70,8 @@ auto checkError(auto res, std::source_location const& loc = std::source_location
     return res;
 }
 
-struct IoFilePromise : Promise<IoEventMask> {
-
-    auto get_return_object() {
-        return std::coroutine_handle<IoFilePromise>::from_promise(*this);
-    }
-
-    ~IoFilePromise();
-
-    IoFilePromise& operator=(IoFilePromise&&) = delete;
-
-    // Promise和IoLoop相互依赖,所以这里用指针,并且析构函数要放下实现,还要记得+inline
-    // struct IoLoop *mLoop;
-    // int mFd;
-    // uint32_t mEvents;
-
-    // 直接记录Awaiter,由Awaiter记录信息
-    struct IoFileAwaiter *mAwaiter{};
-};
+// 等待fd事件的Awaiter, 挂起时直接把自己挂到IoLoop的登记项上
+struct IoFileAwaiter;
 
 // 对文件描述符进行封装
 // [[nodiscard]] 如果没有co_await会警告
@@ -128,20 +124,245 @@ private:
     int mFd;
 };
 
+// 每个fd在IoLoop中的登记项,以fd为下标存放在IoLoop::mFiles中
+// fd第一次被等待的时候以ET模式(EPOLLIN|EPOLLOUT)加入epoll,之后一直保持注册,直到removeListener
+// 这样每次读写就不用再EPOLL_CTL_ADD/EPOLL_CTL_DEL,一次读写省掉两次epoll_ctl
+struct IoFileEntry {
+    // 当前挂在这个fd上等待的协程, 读写两个方向各一个槽
+    // 这样一个协程在写响应的同时,另一个协程可以在同一个连接上读下一个请求
+    IoFileAwaiter *mReader{};
+    IoFileAwaiter *mWriter{};
+    // ET模式只通知一次,触发了但还没人消费的事件要记下来
+    IoEventMask mReady = 0;
+    // 上一次read/write已经把fd读空/写满了(EAGAIN或者没读满),下一次就不要先试了,直接等事件
+    // 收到对应的边沿之后清掉, 初始为0: 还不知道就先乐观地试一次
+    IoEventMask mDrained = 0;
+    bool mRegistered = false;
+    // 普通文件加入epoll会EPERM,这种fd永远视为就绪
+    bool mPollable = true;
+    // 在第几批事件分发期间注册的: 同一批里的事件是注册之前取出来的, 属于之前用这个fd号的文件
+    std::uint64_t mBatch = 0;
+
+    // 等EPOLLIN的挂在读槽上, 只等EPOLLOUT的挂在写槽上
+    IoFileAwaiter *&waiterSlot(IoEventMask events) noexcept {
+        return (events & EPOLLIN) || !(events & EPOLLOUT) ? mReader : mWriter;
+    }
+};
+
+// 事件循环的统计信息, 用来衡量批大小和busy-poll到底值不值(CPU换尾延迟)
+struct IoLoopStats {
+    // 阻塞式epoll_wait的次数(真正让出CPU的次数)
+    std::size_t mWakeups = 0;
+    // busy-poll时0超时epoll_wait的次数
+    std::size_t mSpins = 0;
+    // busy-poll期间拿到事件的次数,也就是省掉一次睡眠/唤醒的次数
+    std::size_t mSpinHits = 0;
+    // 收到的事件总数
+    std::size_t mEvents = 0;
+    // 事件把缓冲区填满的次数,说明这一轮可能还有事件没取出来
+    std::size_t mFullBatches = 0;
+    // 当前一次epoll_wait最多取多少个事件
+    std::size_t mBatchSize = 0;
+};
+
+// 其他线程投递过来要在这个loop上resume的协程, 串在IoLoop的无锁队列里
+// resume_on的Awaiter自己就是节点(在协程帧里); post(loop, 协程)没有地方放节点,只能new一个, mOwned表示用完要delete
+struct IoRemoteNode {
+    IoRemoteNode *mNext{};
+    std::coroutine_handle<> mCoroutine{};
+    bool mOwned = false;
+};
+
 // 一个loop对应一个epoll
-// event_loop.hpp中直接覆写IoLoop
-// 也就是说下面的IoLoop并不会被用到
 struct IoLoop {
-    bool addListener(IoFilePromise &promise, int op);
+    IoLoop() {
+        mEventBuf.resize(mMinBatch);
+        // eventfd也注册进epoll, 其他线程投递协程之后写它一下, 把阻塞在epoll_wait里的loop叫醒
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = mWakeFd;
+        checkError(epoll_ctl(mEpfd, EPOLL_CTL_ADD, mWakeFd, &event));
+    }
+
+    // 别的事件源(比如io_uring的ring fd)也挂到这个epoll上, 只用来把epoll_wait叫醒, 事件由调用者自己处理
+    // 水平触发: 调用者没处理完之前每次epoll_wait都会马上返回
+    void addWakeSource(int fd) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        checkError(epoll_ctl(mEpfd, EPOLL_CTL_ADD, fd, &event));
+        mWakeSource = fd;
+    }
+
+    // 找到fd的登记项,第一次用到的时候顺便注册进epoll
+    // 共享模式下调用者要先持有lockIfShared()
+    IoFileEntry &getEntry(AsyncFile &file);
 
+    // 事件已经就绪就直接取走返回false; 否则把协程挂到fd上返回true
+    // fd上同一方向已经有协程在等了也返回false, 并标记mBusy(co_await抛EBUSY)
+    // 检查和挂起在同一把锁里完成, 共享模式下不会和别的线程的事件分发错过
+    bool addListener(IoFileAwaiter &awaiter);
+
+    // 还没等到就不等了(Awaiter析构), 从登记项上摘下来
+    void cancelListener(IoFileAwaiter &awaiter) noexcept;
+
+    // 协程的取消信号被触发了; 共享模式(setResumeHook)下可以在任何线程调用, 否则只能在运行tryRun的线程上调用
+    // 还挂在登记项上就摘下来投递回loop, 由tryRun resume(co_await抛ECANCELED); 已经被事件唤醒了就什么都不做
+    void cancelAwaiter(IoFileAwaiter &awaiter);
+
+    // deadline到了, 由TimerLoop在自己的线程上调用
+    // 还挂在登记项上就摘下来直接resume(co_await抛ETIMEDOUT); 已经被事件唤醒了就什么都不做
+    void expireAwaiter(IoFileAwaiter &awaiter);
+
+    // 不再监听这个fd, 关闭fd之前必须调用,否则fd号被复用的时候登记项就过期了(一般直接用close_file)
     void removeListener(AsyncFile &file) {
-        checkError(epoll_ctl(mEpfd, EPOLL_CTL_DEL, file.fileNo(), nullptr));
-        --mCount;
+        auto lock = lockIfShared();
+        int fd = file.fileNo();
+        if (fd < 0 || (std::size_t)fd >= mFiles.size()) return;
+        auto &entry = mFiles[fd];
+        if (entry.mRegistered && entry.mPollable)
+            epoll_ctl(mEpfd, EPOLL_CTL_DEL, fd, nullptr);
+        if (entry.mReader) --mCount;
+        if (entry.mWriter) --mCount;
+        entry = IoFileEntry();
+    }
+
+    // read/write没有读干净/写满,说明fd仍然就绪,把事件放回去,下次等待直接返回
+    void markReady(AsyncFile &file, IoEventMask events) {
+        auto lock = lockIfShared();
+        getEntry(file).mReady |= events;
+    }
+
+    bool isDrained(AsyncFile &file, IoEventMask events) {
+        auto lock = lockIfShared();
+        return getEntry(file).mDrained & events;
+    }
+
+    // 系统调用返回EAGAIN或者没读满/写满,之前缓存的就绪事件也就过期了
+    void markDrained(AsyncFile &file, IoEventMask events) {
+        auto lock = lockIfShared();
+        auto &entry = getEntry(file);
+        if (!entry.mPollable) return;
+        entry.mDrained |= events;
+        entry.mReady &= ~events;
+    }
+
+    bool hasEvent() const {
+        if (mRemoteCount.load(std::memory_order_relaxed) != 0) return true;
+        auto lock = lockIfShared();
+        return mCount != 0;
+    }
+
+    // 下面三个可以在任何线程调用
+    // 把协程交给这个loop, 由运行tryRun的线程resume
+    void post(IoRemoteNode &node) {
+        mRemoteCount.fetch_add(1, std::memory_order_relaxed);
+        mRemoteQueue.push(&node);
+        wakeup();
+    }
+
+    void post(std::coroutine_handle<> coroutine) {
+        post(*new IoRemoteNode{nullptr, coroutine, true});
+    }
+
+    // 叫醒阻塞在epoll_wait里的loop
+    // 合并唤醒: 上一次写的eventfd还没被loop读走的话就不用再写了, 一连串post只要一次write
+    void wakeup() {
+        if (mWakePending.exchange(true, std::memory_order_seq_cst)) return;
+        std::uint64_t one = 1;
+        [[maybe_unused]] auto rt = write(mWakeFd, &one, sizeof(one));
+    }
+
+    bool tryRun(std::optional<std::chrono::steady_clock::duration> timeout = std::nullopt);
+
+    // 一次epoll_wait最多取多少个事件: 从minBatch开始,取满了就翻倍,直到maxBatch
+    void setBatchSize(std::size_t minBatch, std::size_t maxBatch) {
+        mMinBatch = std::max<std::size_t>(minBatch, 1);
+        mMaxBatch = std::max(maxBatch, mMinBatch);
+        mEventBuf.resize(mMinBatch);
+        mLowBatches = 0;
+    }
+
+    // 低延迟模式: 阻塞之前先用0超时的epoll_wait空转最多budget这么久, 0表示关闭
+    void setBusyPoll(std::chrono::nanoseconds budget) {
+        mBusyPoll = budget;
+    }
+
+    // 亚毫秒的超时默认用epoll_pwait2, 一次系统调用, 但会被线程的timer slack(默认50us)推迟
+    // 设为true就总是用timerfd(精度更高, 每次等待多一次timerfd_settime)
+    void setPreciseTimeout(bool precise) noexcept {
+        mPreciseTimeout = precise;
+    }
+
+    // 事件到了之后不在当前线程直接resume, 而是交给resume(ctx, 协程)去调度(比如投递到多线程调度器的队列里)
+    // 设置之后这个loop会被多个线程同时使用: 只有一个线程调用tryRun, 其他线程在上面读写/挂起,
+    // 所以登记表的访问都要加锁; 不设置的话lockIfShared什么都不做, 单线程没有额外开销
+    // 共享模式下带deadline的等待挂在loop自己的TimerLoop上(加锁, 由运行tryRun的线程调用runTimers驱动),
+    // 不能用挂起时所在线程的getTimerLoop(): 协程可能在别的工作线程上醒来, 摘超时节点的时候就跨线程了
+    void setResumeHook(void *ctx, void (*resume)(void *, std::coroutine_handle<>)) {
+        auto lock = std::lock_guard(mMutex);
+        mResumeCtx = ctx;
+        mResumeFn = resume;
+        mShared = resume != nullptr;
+        if (mShared && !mSharedTimerLoop) mSharedTimerLoop.emplace();
+        // 还有超时节点挂着(调度器析构丢下的协程)就留着, 节点析构的时候还要从上面摘
+        if (!mShared && mSharedTimerLoop && !mSharedTimerLoop->hasTimer()) mSharedTimerLoop.reset();
+    }
+
+    // 共享模式下由运行tryRun的线程在每次tryRun之前调用: 触发到期的IO超时, 返回tryRun最多等多久
+    // 其他线程加了更早的deadline会叫醒它(addDeadline)
+    std::optional<std::chrono::steady_clock::duration> runTimers() {
+        auto lock = lockIfShared();
+        if (!mSharedTimerLoop) return std::nullopt;
+        auto timeout = mSharedTimerLoop->run();
+        mTimerWake = timeout ? mSharedTimerLoop->now() + *timeout : TimerLoop::Clock::time_point::max();
+        return timeout;
+    }
+
+    // 和TimerLoop配合: epoll_wait醒来之后让TimerLoop缓存的当前时间失效
+    // 不然阻塞了很久才醒来的协程sleep_for的时候会拿到睡之前的时间
+    void setTimerLoop(TimerLoop &timerLoop) noexcept {
+        mTimerLoop = &timerLoop;
+    }
+
+    // 带deadline的IO等待把超时挂在这个TimerLoop上: 共享模式下是loop自己的, 否则是setTimerLoop设置的,
+    // 都没有就用当前线程的; 共享模式下要持有lockIfShared()
+    TimerLoop &timerLoop() noexcept {
+        if (mSharedTimerLoop) return *mSharedTimerLoop;
+        return mTimerLoop ? *mTimerLoop : getTimerLoop();
+    }
+
+    // 在锁里插入/摘掉IO等待的超时节点; 插入的比运行tryRun的线程打算醒来的时间早就叫醒它
+    void addDeadline(TimerNode &node) {
+        auto lock = lockIfShared();
+        timerLoop().addTimer(node);
+        if (mSharedTimerLoop && node.latestTime() < mTimerWake) {
+            mTimerWake = node.latestTime();
+            wakeup();
+        }
     }
 
-    bool hasEvent() const noexcept { return mCount != 0; }
+    template <class Node>
+    void dropDeadline(std::optional<Node> &node) {
+        if (!node) return;
+        auto lock = lockIfShared();
+        node.reset();
+    }
 
-    bool tryRun(std::optional<std::chrono::system_clock::duration> timeout = std::nullopt);
+    // 取消/超时: 先记下原因(reason指向Awaiter里的标志), 还挂着就从登记项上摘下来返回true
+    bool abortListener(IoFileAwaiter &awaiter, bool IoFileAwaiter::*reason);
+
+    // 可重入: runTimers持锁触发超时, 超时回调(expireAwaiter)里还要再拿一次
+    std::unique_lock<std::recursive_mutex> lockIfShared() const {
+        if (!mShared) return {};
+        return std::unique_lock(mMutex);
+    }
+
+    IoLoopStats stats() const noexcept {
+        IoLoopStats s = mStats;
+        s.mBatchSize = mEventBuf.size();
+        return s;
+    }
 
     void process() {
         while (1) {
@@ -154,106 +375,454 @@ struct IoLoop {
     IoLoop& operator = (IoLoop&&) = delete;
 
     ~IoLoop() {
+        for (auto *node = mRemoteQueue.popAll(); node;) {
+            auto *next = node->mNext;
+            if (node->mOwned) delete node;
+            node = next;
+        }
+        close(mWakeFd);
+        if (mTimerFd != -1) close(mTimerFd);
         close(mEpfd);
     }
 
+    // 读掉eventfd, resume所有投递过来的协程
+    void drainRemote();
+
+    // epoll_wait只有毫秒精度, 不是整毫秒的超时用epoll_pwait2或者timerfd
+    int waitEvents(int batch, std::optional<std::chrono::steady_clock::duration> timeout);
+
+    // 上一次用timerfd等的超时还没到, 这次不用了就关掉, 免得之后白白醒一次
+    void disarmTimerFd() {
+        if (!mTimerFdArmed) return;
+        struct itimerspec its{};
+        timerfd_settime(mTimerFd, 0, &its, nullptr);
+        mTimerFdArmed = false;
+    }
+
     // C++11 直接在结构体中初始化一个变量
     int mEpfd = checkError(epoll_create1(0));
+    int mWakeFd = checkError(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
 
-    std::size_t mCount = 0;
+    MpscQueue<IoRemoteNode> mRemoteQueue;
+    // 投递了还没resume的协程数, 算在hasEvent里, 不然loop可能以为没事干了就退出
+    std::atomic<std::size_t> mRemoteCount{0};
+    std::atomic<bool> mWakePending{false};
 
-    struct epoll_event mEventBuf[64];
+    // 亚毫秒超时: 优先epoll_pwait2, 内核不支持的时候第一次用到才创建timerfd
+    bool mPwait2 = true;
+    bool mPreciseTimeout = false;
+    int mTimerFd = -1;
+    int mWakeSource = -1;
+    bool mTimerFdArmed = false;
+
+    // 正在等待的协程数量
+    std::size_t mCount = 0;
+    // epoll_wait取回来的第几批事件, 由mMutex保护
+    std::uint64_t mBatch = 0;
+
+    std::vector<IoFileEntry> mFiles;
+
+    std::vector<struct epoll_event> mEventBuf;
+    std::size_t mMinBatch = 64;
+    std::size_t mMaxBatch = 1024;
+    // 连续多少次连1/4都没取满, 到一定次数就缩小批大小
+    std::size_t mLowBatches = 0;
+    std::chrono::nanoseconds mBusyPoll{0};
+    IoLoopStats mStats;
+
+    TimerLoop *mTimerLoop = nullptr;
+    void *mResumeCtx = nullptr;
+    void (*mResumeFn)(void *, std::coroutine_handle<>) = nullptr;
+    bool mShared = false;
+    mutable std::recursive_mutex mMutex;
+    // 共享模式下IO超时用的定时器和运行tryRun的线程打算醒来的时间, 都由mMutex保护
+    std::optional<TimerLoop> mSharedTimerLoop;
+    TimerLoop::Clock::time_point mTimerWake = TimerLoop::Clock::time_point::max();
 };
-// 保存的所有东西都丢到这里,Promise中只保存一个Awaiter对象即可
-struct IoFileAwaiter {
+
+// 等待fd事件不再单独开一个协程(以前是Task<IoEventMask, IoFilePromise>,每次等待都要new一个协程帧)
+// 而是由wait_file_event按值返回这个Awaiter, 挂起期间它就住在调用者的协程帧里,
+// 登记项里直接记录Awaiter的地址, 事件到了resume里面的协程句柄, 一次等待零次堆分配
+// 可以带一个deadline: 超时节点就在Awaiter里面, 挂起的时候插进TimerLoop, 到了还没等到事件就抛ETIMEDOUT
+// 不用when_any/limit_timeout, 一次带超时的等待只是多一次定时器插入, 没有额外的协程帧
+struct [[nodiscard]] IoFileAwaiter {
+    IoFileAwaiter(IoLoop &loop, AsyncFile &file, IoEventMask events,
+                  std::optional<TimerLoop::Clock::time_point> deadline = std::nullopt) noexcept
+        : mLoop(loop), mFd(file), mEvents(events), mDeadline(deadline) {}
+
+    // 登记项里记的是地址, 挂起之后就不能再拷贝了(挂起之前被拷贝没关系,比如GCC对左值co_await会拷贝一份)
+    IoFileAwaiter(IoFileAwaiter const& that) noexcept
+        : mLoop(that.mLoop), mFd(that.mFd), mEvents(that.mEvents), mDeadline(that.mDeadline) {}
+
+    // 挂起的协程被销毁了,Awaiter跟着析构,要从登记项上摘下来
+    ~IoFileAwaiter() {
+        mStopCallback.reset();
+        mLoop.dropDeadline(mTimeout);
+        if (mParked) mLoop.cancelListener(*this);
+    }
 
     bool await_ready() const noexcept { return false; }
 
-    void await_suspend(std::coroutine_handle<IoFilePromise> coroutine) {
-        auto &promise = coroutine.promise();
-        promise.mAwaiter = this;
-        if (!mLoop.addListener(promise, op)) {
-            // 添加失败
-            promise.mAwaiter = nullptr;
-            coroutine.resume();
+    // 调用者有取消信号就注册一个回调, 取消的时候从登记项上摘下来
+    template <class P>
+    bool await_suspend(std::coroutine_handle<P> coroutine) {
+        mPrevious = coroutine;
+        if constexpr (requires { coroutine.promise().mStopToken; }) {
+            // 已经取消了的话回调马上执行, addListener看到mCanceled就不会挂起
+            if (coroutine.promise().mStopToken.stop_possible())
+                mStopCallback.emplace(coroutine.promise().mStopToken, Cancel{this});
         }
+        // 超时节点要在挂上登记项之前插进去, 返回true之后可能马上就被别的线程resume了,不能再碰this
+        if (mDeadline) {
+            auto &node = mTimeout.emplace();
+            node.mAwaiter = this;
+            node.mExpireTime = *mDeadline;
+            node.mOnExpire = onTimeout;
+            mLoop.addDeadline(node);
+        }
+        if (mLoop.addListener(*this)) return true;
+        mLoop.dropDeadline(mTimeout);
+        return false;
     }
 
-    IoEventMask await_resume() const noexcept {
+    IoEventMask await_resume() {
+        // 回调可能正在别的线程上执行, 注销的时候会等它结束, 之后再看mCanceled
+        mStopCallback.reset();
+        // 没到期的超时节点析构的时候自己从TimerLoop上摘掉
+        mLoop.dropDeadline(mTimeout);
+        // 取消/超时和事件同时到达的话以事件为准
+        if (!mResumeEvents) [[unlikely]] {
+            if (mCanceled) throw std::system_error(ECANCELED, std::system_category());
+            if (mTimedOut) throw std::system_error(ETIMEDOUT, std::system_category());
+            if (mBusy) throw std::system_error(EBUSY, std::system_category());
+        }
         return mResumeEvents;
     }
 
-    using ClockType = std::chrono::system_clock;
+    struct TimeoutNode : TimerNode {
+        IoFileAwaiter *mAwaiter{};
+    };
+
+    static void onTimeout(TimerNode &node) {
+        auto *self = static_cast<TimeoutNode &>(node).mAwaiter;
+        self->mLoop.expireAwaiter(*self);
+    }
+
+    struct Cancel {
+        void operator()() const noexcept {
+            mSelf->mLoop.cancelAwaiter(*mSelf);
+        }
+
+        IoFileAwaiter *mSelf;
+    };
+
+    using ClockType = std::chrono::steady_clock;
+
+    // 等到之后会被清掉的事件, ERR/HUP/RDHUP是持续状态,不消费
+    static constexpr IoEventMask kConsumable = EPOLLIN | EPOLLOUT | EPOLLPRI;
 
     IoLoop &mLoop;
-    // int mFd;
     AsyncFile &mFd;
     IoEventMask mEvents;
     IoEventMask mResumeEvents = 0;
-    int op = EPOLL_CTL_ADD;
+    std::coroutine_handle<> mPrevious{};
+    bool mParked = false;
+    bool mCanceled = false;
+    bool mTimedOut = false;
+    // 同一个fd同一个方向上已经有别的协程在等了
+    bool mBusy = false;
+    std::optional<TimerLoop::Clock::time_point> mDeadline;
+    std::optional<TimeoutNode> mTimeout;
+    // 取消之后投递回loop用的节点
+    IoRemoteNode mCancelNode{};
+    std::optional<std::stop_callback<Cancel>> mStopCallback;
 };
 
 
-inline
-IoFilePromise::~IoFilePromise() {
-    mAwaiter->mLoop.removeListener(mAwaiter->mFd);
+inline IoFileEntry &
+IoLoop::getEntry(AsyncFile &file) {
+    int fd = file.fileNo();
+    if ((std::size_t)fd >= mFiles.size()) mFiles.resize(fd + 1);
+    auto &entry = mFiles[fd];
+    if (!entry.mRegistered) [[unlikely]] {
+        // fd号被复用: 不能继承上一个文件留下的事件(比如一直不会被消费的EPOLLHUP)
+        entry.mReady = 0;
+        entry.mDrained = 0;
+        entry.mBatch = mBatch;
+        struct epoll_event event;
+        // ET模式, 读写一起注册, 之后谁在等就唤醒谁
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.fd = fd;
+        if (epoll_ctl(mEpfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            if (errno != EPERM) [[unlikely]] checkError(-1);
+            entry.mPollable = false;
+            entry.mReady = ~IoEventMask(0);
+        } else {
+            // ET模式下read/write必须是非阻塞的
+            file.setNonblock();
+        }
+        entry.mRegistered = true;
+    }
+    return entry;
 }
 
 inline bool 
-IoLoop::addListener(IoFilePromise &promise, int op) {
-    struct epoll_event event;
-    // EPOLLONSHOT 只触发一次 -> 避免对同一个fd重复添加相同event
-    event.events = promise.mAwaiter->mEvents;
-    event.data.ptr = &promise;
-    // 服务器一旦运行起来,如果你下面直接抛出异常了,那还服务啥??
-    // checkError(epoll_ctl(mEpfd, EPOLL_CTL_ADD, promise.mAwaiter->mFd, &event));
-    int rt = epoll_ctl(mEpfd, op, promise.mAwaiter->mFd.fileNo(), &event);
-    if (rt == -1) return false;
-    if (op == EPOLL_CTL_ADD) mCount++;
+IoLoop::addListener(IoFileAwaiter &awaiter) {
+    auto lock = lockIfShared();
+    if (awaiter.mCanceled || awaiter.mTimedOut) [[unlikely]] return false;
+    auto &entry = getEntry(awaiter.mFd);
+    // 之前已经触发过了,不用挂起
+    if (IoEventMask ready = entry.mReady & (awaiter.mEvents | EPOLLERR | EPOLLHUP)) {
+        if (entry.mPollable) entry.mReady &= ~(awaiter.mEvents & IoFileAwaiter::kConsumable);
+        awaiter.mResumeEvents = ready;
+        return false;
+    }
+    auto &slot = entry.waiterSlot(awaiter.mEvents);
+    // 同一个方向上已经有协程在等了, 一个槽只能挂一个, 不能当成等到了(没有事件, 调用者会一直重试)
+    if (slot) [[unlikely]] {
+        awaiter.mBusy = true;
+        return false;
+    }
+    slot = &awaiter;
+    awaiter.mParked = true;
+    ++mCount;
+    return true;
+}
+
+inline void
+IoLoop::cancelListener(IoFileAwaiter &awaiter) noexcept {
+    auto lock = lockIfShared();
+    auto &slot = mFiles[awaiter.mFd.fileNo()].waiterSlot(awaiter.mEvents);
+    if (slot == &awaiter) {
+        slot = nullptr;
+        --mCount;
+    }
+    awaiter.mParked = false;
+}
+
+inline bool
+IoLoop::abortListener(IoFileAwaiter &awaiter, bool IoFileAwaiter::*reason) {
+    auto lock = lockIfShared();
+    // 和addListener在同一把锁里, 要么它看到标志不挂起, 要么这里看到它已经挂上了
+    awaiter.*reason = true;
+    if (!awaiter.mParked) return false;
+    mFiles[awaiter.mFd.fileNo()].waiterSlot(awaiter.mEvents) = nullptr;
+    awaiter.mParked = false;
+    --mCount;
     return true;
 }
 
+inline void
+IoLoop::cancelAwaiter(IoFileAwaiter &awaiter) {
+    if (!abortListener(awaiter, &IoFileAwaiter::mCanceled)) return;
+    awaiter.mCancelNode.mCoroutine = awaiter.mPrevious;
+    post(awaiter.mCancelNode);
+}
+
+inline void
+IoLoop::expireAwaiter(IoFileAwaiter &awaiter) {
+    if (!abortListener(awaiter, &IoFileAwaiter::mTimedOut)) return;
+    auto coroutine = awaiter.mPrevious;
+    if (mResumeFn) mResumeFn(mResumeCtx, coroutine);
+    else coroutine.resume();
+}
+
 inline bool 
-IoLoop::tryRun(std::optional<std::chrono::system_clock::duration> timeout) {
-    if (mCount == 0) {
-        PRINT_S(没事件);
-        PRINT_S(应该退出但是继续监听);
-        // return false;
-    }
-    int timeoutInMs = 1000;
-    if (timeout) timeoutInMs = std::chrono::duration_cast<std::chrono::milliseconds>(*timeout).count();
-    PRINT(timeoutInMs);
-    int rt = checkError(epoll_wait(mEpfd, mEventBuf, 10, timeoutInMs));
-    if (rt > 0) {
-        // PRINT_S(getEvent!);
-        for (int i = 0; i < rt; ++i) {
-            auto &event = mEventBuf[i];
-            auto &promise = *(IoFilePromise *)mEventBuf[i].data.ptr;
-            //checkError(epoll_ctl(mEpfd, EPOLL_CTL_DEL, promise.mFd, nullptr));
-            // 下面promise 对应的协程句柄执行完就会析构掉promise,也就会析构掉事件
-            // 这个promise就剩下一个省略的co_return了
-            // std::coroutine_handle<IoFilePromise>::from_promise(promise).resume();
-            // 先开香槟,后触发,再返回
-            promise.mAwaiter->mResumeEvents = event.events;
+IoLoop::tryRun(std::optional<std::chrono::steady_clock::duration> timeout) {
+    // 没有超时就一直阻塞到有事件为止
+    if (timeout && *timeout < timeout->zero()) timeout = timeout->zero();
+    int batch = (int)mEventBuf.size();
+    int rt = 0;
+    // busy-poll: 先空转一会儿,拿到事件就不用睡眠/唤醒了
+    if (mBusyPoll.count() > 0 && (!timeout || timeout->count() > 0)) {
+        auto budget = mBusyPoll;
+        if (timeout) budget = std::min<std::chrono::nanoseconds>(budget, *timeout);
+        auto deadline = std::chrono::steady_clock::now() + budget;
+        do {
+            ++mStats.mSpins;
+            rt = epoll_wait(mEpfd, mEventBuf.data(), batch, 0);
+        } while (rt == 0 && std::chrono::steady_clock::now() < deadline);
+        if (rt > 0) ++mStats.mSpinHits;
+    }
+    if (rt == 0) {
+        ++mStats.mWakeups;
+        rt = waitEvents(batch, timeout);
+    }
+    if (rt == -1 && errno == EINTR) rt = 0;
+    checkError(rt);
+    if (mTimerLoop) mTimerLoop->invalidateNow();
+    mStats.mEvents += rt;
+    // 自适应批大小: 取满了说明负载高,下次多取一些; 长时间很空闲再慢慢缩回去
+    if (rt == batch) {
+        ++mStats.mFullBatches;
+        mLowBatches = 0;
+        if (mEventBuf.size() < mMaxBatch) mEventBuf.resize(std::min(mEventBuf.size() * 2, mMaxBatch));
+    } else if ((std::size_t)rt * 4 < (std::size_t)batch && mEventBuf.size() > mMinBatch) {
+        if (++mLowBatches >= 64) {
+            mLowBatches = 0;
+            mEventBuf.resize(std::max(mEventBuf.size() / 2, mMinBatch));
         }
-
-        // 所有promise已就绪
-        for (int i = 0; i < rt; ++i) {
-            auto &event = mEventBuf[i];
-            auto &promise = *(IoFilePromise *)event.data.ptr;
-            std::coroutine_handle<IoFilePromise>::from_promise(promise).resume();
+    } else {
+        mLowBatches = 0;
+    }
+    {
+        auto lock = lockIfShared();
+        ++mBatch;
+    }
+    for (int i = 0; i < rt; ++i) {
+        auto &event = mEventBuf[i];
+        int fd = event.data.fd;
+        if (fd == mWakeFd) {
+            drainRemote();
+            continue;
+        }
+        if (fd == mWakeSource) continue;
+        if (fd == mTimerFd) {
+            // 只是用来叫醒epoll_wait的, 读掉就行, 到期的定时器由TimerLoop处理
+            std::uint64_t expirations;
+            [[maybe_unused]] auto n = read(mTimerFd, &expirations, sizeof(expirations));
+            mTimerFdArmed = false;
+            continue;
+        }
+        {
+            auto lock = lockIfShared();
+            // 这一批里前面resume的协程可能已经close_file了这个fd(登记项被清掉), 甚至又有新文件用上了这个号,
+            // 事件属于已经关掉的文件, 丢掉
+            auto &entry = mFiles[fd];
+            if (!entry.mRegistered || entry.mBatch == mBatch) continue;
+            entry.mReady |= event.events;
+            entry.mDrained &= ~event.events;
+        }
+        // 读写两个槽分别看要不要唤醒
+        // 摘下来马上resume: resume的协程可能销毁别的Awaiter(它们析构时会自己摘掉),也可能注册新fd让mFiles扩容,
+        // 所以不能先攒一批再resume,并且每次都重新按fd取登记项
+        for (auto slot : {&IoFileEntry::mReader, &IoFileEntry::mWriter}) {
+            std::coroutine_handle<> coroutine;
+            {
+                auto lock = lockIfShared();
+                auto &entry = mFiles[fd];
+                auto *awaiter = entry.*slot;
+                if (!awaiter) continue;
+                IoEventMask events = entry.mReady & (awaiter->mEvents | EPOLLERR | EPOLLHUP);
+                if (!events) continue;
+                entry.mReady &= ~(awaiter->mEvents & IoFileAwaiter::kConsumable);
+                awaiter->mResumeEvents = events;
+                awaiter->mParked = false;
+                entry.*slot = nullptr;
+                --mCount;
+                coroutine = awaiter->mPrevious;
+            }
+            if (mResumeFn) mResumeFn(mResumeCtx, coroutine);
+            else coroutine.resume();
         }
     }
     return true;
 }
 
+inline int
+IoLoop::waitEvents(int batch, std::optional<std::chrono::steady_clock::duration> timeout) {
+    if (!timeout || timeout->count() == 0 || *timeout % std::chrono::milliseconds(1) == timeout->zero()) {
+        disarmTimerFd();
+        int ms = -1;
+        if (timeout) ms = (int)std::min<long>(std::chrono::duration_cast<std::chrono::milliseconds>(*timeout).count(), INT_MAX);
+        return epoll_wait(mEpfd, mEventBuf.data(), batch, ms);
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(*timeout).count();
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+#ifdef SYS_epoll_pwait2
+    // epoll_pwait2(5.11+)直接接受纳秒超时, 不支持(或者被seccomp拦了)就记下来以后都走timerfd
+    if (mPwait2 && !mPreciseTimeout) {
+        int rt = (int)syscall(SYS_epoll_pwait2, mEpfd, mEventBuf.data(), batch, &ts, nullptr, 0);
+        if (rt != -1 || (errno != ENOSYS && errno != EPERM)) return rt;
+        mPwait2 = false;
+    }
+#endif
+    // 把timerfd设成超时时间, 然后无限等, timerfd到期本身就是一个事件
+    if (mTimerFd == -1) {
+        mTimerFd = checkError(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = mTimerFd;
+        checkError(epoll_ctl(mEpfd, EPOLL_CTL_ADD, mTimerFd, &event));
+    }
+    struct itimerspec its{};
+    its.it_value = ts;
+    checkError(timerfd_settime(mTimerFd, 0, &its, nullptr));
+    mTimerFdArmed = true;
+    return epoll_wait(mEpfd, mEventBuf.data(), batch, -1);
+}
+
+inline void
+IoLoop::drainRemote() {
+    std::uint64_t value;
+    [[maybe_unused]] auto rt = read(mWakeFd, &value, sizeof(value));
+    // 先清标志再取队列: 取完之后再来的post一定会重新写eventfd
+    mWakePending.store(false, std::memory_order_seq_cst);
+    for (auto *node = mRemoteQueue.popAll(); node;) {
+        // resume之后节点(Awaiter)可能已经没了, 先把要用的拿出来
+        auto *next = node->mNext;
+        auto coroutine = node->mCoroutine;
+        if (node->mOwned) delete node;
+        mRemoteCount.fetch_sub(1, std::memory_order_relaxed);
+        if (mResumeFn) mResumeFn(mResumeCtx, coroutine);
+        else coroutine.resume();
+        node = next;
+    }
+}
+
+// 在其他线程把协程交给loop
+inline void post(IoLoop &loop, std::coroutine_handle<> coroutine) {
+    loop.post(coroutine);
+}
+
+// co_await resume_on(loop): 挂起当前协程, 之后在运行loop的线程上继续执行
+// 比如线程池里算完了, 再回到网络线程上把结果写回连接
+struct [[nodiscard]] ResumeOnAwaiter : IoRemoteNode {
+    explicit ResumeOnAwaiter(IoLoop &loop) noexcept : mLoop(loop) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> coroutine) {
+        mCoroutine = coroutine;
+        // post之后可能马上就被loop线程resume了, 不能再碰this
+        mLoop.post(*this);
+    }
+
+    void await_resume() const noexcept {}
+
+    IoLoop &mLoop;
+};
+
+inline ResumeOnAwaiter resume_on(IoLoop &loop) {
+    return ResumeOnAwaiter(loop);
+}
+
+// 协程离开loop去别的线程干活的时候, loop上可能什么都没在等, AsyncLoop会以为活都干完了直接退出
+// 离开之前拿一个guard, 回到loop之后再放掉, 期间loop一直算作有事件
+struct IoWorkGuard {
+    explicit IoWorkGuard(IoLoop &loop) noexcept : mLoop(loop) {
+        mLoop.mRemoteCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    IoWorkGuard(IoWorkGuard &&) = delete;
+
+    ~IoWorkGuard() {
+        mLoop.mRemoteCount.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    IoLoop &mLoop;
+};
+
 
 // wait_file 调用成功之后返回 触发了哪些事件,所以类型为 uint32_t
+// fd一直注册在epoll中,这里只是把当前协程挂到fd的登记项上
+// deadline: 到了还没等到就抛ETIMEDOUT
 inline
-Task<IoEventMask, IoFilePromise>
-wait_file_event(IoLoop &loop, AsyncFile &file, IoEventMask events) {
-    uint32_t resumeEvents = co_await IoFileAwaiter(loop, file, events | EPOLLONESHOT);
-    co_return resumeEvents;
+IoFileAwaiter wait_file_event(IoLoop &loop, AsyncFile &file, IoEventMask events,
+                              std::optional<TimerLoop::Clock::time_point> deadline = std::nullopt) {
+    return IoFileAwaiter(loop, file, events, deadline);
 }
 
 // 一次添加一种
@@ -272,33 +841,93 @@ std::size_t writeFileSync(AsyncFile &file, std::span<char const> buffer) {
     return checkError(write(file.fileNo(), buffer.data(), buffer.size()));
 }
 
+// 关闭fd: 先从loop里摘掉登记项再close, 内核复用这个fd号的时候新文件不会继承旧的mRegistered/mDrained
+// AsyncFile析构不关fd, 交给loop等待过的fd都要用这个关; 不能还有协程挂在上面
+inline
+void close_file(IoLoop &loop, AsyncFile &file) {
+    if (file.fileNo() < 0) return;
+    loop.removeListener(file);
+    close(file.releaseOwnership());
+}
+
+// 乐观的非阻塞IO: 先直接调用read/write, 只有EAGAIN了才挂起等待事件
+// 高负载下大部分时候数据已经在缓冲区里了,这样一次读写只要一次系统调用
+// 上一次已经读空/写满的fd(mDrained)就不先试了,直接等下一个边沿
+// deadline是绝对时间(steady_clock), 到了还没读到/写出去就抛ETIMEDOUT
 inline
-Task<std::size_t> read_file(IoLoop &loop, AsyncFile &file, std::span<char> buffer) {
-    co_await wait_file_event(loop, file, EPOLLIN | EPOLLRDHUP); //LT
-    // readFileSync是普通函数,非异步
-    // 这里是LT模式,因为buffer不是无限大,如果有数据就会触发,再到下面来读取数据
-    auto len = readFileSync(file, buffer);
-    co_return len;
+Task<std::size_t> read_file(IoLoop &loop, AsyncFile &file, std::span<char> buffer,
+                            std::optional<TimerLoop::Clock::time_point> deadline = std::nullopt) {
+    bool tryNow = !loop.isDrained(file, EPOLLIN);
+    while (true) {
+        if (tryNow) {
+            ssize_t len = read(file.fileNo(), buffer.data(), buffer.size());
+            if (len != -1 || errno != EAGAIN) {
+                checkError(len);
+                // 没读满,说明内核缓冲区已经空了
+                if ((std::size_t)len < buffer.size()) loop.markDrained(file, EPOLLIN);
+                co_return len;
+            }
+            loop.markDrained(file, EPOLLIN);
+        }
+        co_await wait_file_event(loop, file, EPOLLIN | EPOLLRDHUP, deadline);
+        tryNow = true;
+    }
 }
 
 inline
-Task<std::size_t> write_file(IoLoop &loop, AsyncFile &file, std::span<char const> buffer) {
-    co_await wait_file_event(loop, file, EPOLLOUT | EPOLLHUP);
-    auto len = writeFileSync(file, buffer);
-    co_return len;
+Task<std::size_t> write_file(IoLoop &loop, AsyncFile &file, std::span<char const> buffer,
+                             std::optional<TimerLoop::Clock::time_point> deadline = std::nullopt) {
+    bool tryNow = !loop.isDrained(file, EPOLLOUT);
+    while (true) {
+        if (tryNow) {
+            ssize_t len = write(file.fileNo(), buffer.data(), buffer.size());
+            if (len != -1 || errno != EAGAIN) {
+                checkError(len);
+                if ((std::size_t)len < buffer.size()) loop.markDrained(file, EPOLLOUT);
+                co_return len;
+            }
+            loop.markDrained(file, EPOLLOUT);
+        }
+        co_await wait_file_event(loop, file, EPOLLOUT, deadline);
+        tryNow = true;
+    }
+}
+
+// 一次系统调用写多段(比如缓冲区里的响应头 + 引用的body), 返回写了多少字节, 可能只写了一部分
+// 段数超过IOV_MAX的只写前IOV_MAX段
+inline
+Task<std::size_t> writev_file(IoLoop &loop, AsyncFile &file, std::span<struct iovec const> iov,
+                              std::optional<TimerLoop::Clock::time_point> deadline = std::nullopt) {
+    iov = iov.first(std::min<std::size_t>(iov.size(), IOV_MAX));
+    std::size_t want = 0;
+    for (auto const& v : iov) want += v.iov_len;
+    bool tryNow = !loop.isDrained(file, EPOLLOUT);
+    while (true) {
+        if (tryNow) {
+            ssize_t len = writev(file.fileNo(), iov.data(), (int)iov.size());
+            if (len != -1 || errno != EAGAIN) {
+                checkError(len);
+                if ((std::size_t)len < want) loop.markDrained(file, EPOLLOUT);
+                co_return len;
+            }
+            loop.markDrained(file, EPOLLOUT);
+        }
+        co_await wait_file_event(loop, file, EPOLLOUT, deadline);
+        tryNow = true;
+    }
 }
 
 inline
 Task<std::string> read_string(IoLoop &loop, AsyncFile &file) {
     // 如果是一次性读完缓冲区中所有数据那么,就是用ET模式更高效
-    uint32_t triggeredEvent = co_await wait_file_event(loop, file, EPOLLIN | EPOLLET);
+    uint32_t triggeredEvent = co_await wait_file_event(loop, file, EPOLLIN);
     if (triggeredEvent == EPOLLIN) PRINT_S(triggeredEpollIn);
     std::string s; // 基于MSVC对string进行优化
     ssize_t chunk = 15;
     while (1) {
         size_t exist = s.size();
         s.resize(exist + chunk);
-        ssize_t len = read(0, s.data() + exist, chunk);
+        ssize_t len = read(file.fileNo(), s.data() + exist, chunk);
         if (len == -1) {
             if (errno != EAGAIN) [[unlikely]] 
                 throw std::system_error(errno, std::system_category());
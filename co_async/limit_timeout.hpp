@@ -19,6 +19,7 @@
 
 namespace co_async {
 
+// 超时之后要等被取消的a真正结束(收尾完)才返回nullopt; a如果不响应取消, 这个超时也就一直不返回
 template <Awaitable A, class Rep, class Period>
 Task<std::optional<typename AwaitableTraits<A>::RetType>>
 limit_timeout(TimerLoop &loop, A &&a, std::chrono::duration<Rep, Period> duration) {
@@ -37,4 +38,23 @@ limit_timeout(TimerLoop &loop, A &&a, std::chrono::time_point<Clk, Dur> expireTi
     else co_return std::nullopt;
 }
 
+// 超时允许晚slack触发, 大量连接的空闲超时可以合并成很少几次唤醒
+template <Awaitable A, class Rep, class Period, class SRep, class SPeriod>
+Task<std::optional<typename AwaitableTraits<A>::RetType>>
+limit_timeout(TimerLoop &loop, A &&a, std::chrono::duration<Rep, Period> duration, std::chrono::duration<SRep, SPeriod> slack) {
+    auto v = co_await when_any(std::forward<A>(a), sleep_for(loop, duration, slack));
+    if (auto *ret = std::get_if<0>(&v))
+        co_return std::move(*ret);
+    else co_return std::nullopt;
+}
+
+template <Awaitable A, class Clk, class Dur, class SRep, class SPeriod>
+Task<std::optional<typename AwaitableTraits<A>::RetType>>
+limit_timeout(TimerLoop &loop, A &&a, std::chrono::time_point<Clk, Dur> expireTime, std::chrono::duration<SRep, SPeriod> slack) {
+    auto v = co_await when_any(std::forward<A>(a), sleep_until(loop, expireTime, slack));
+    if (auto *ret = std::get_if<0>(&v))
+        co_return std::move(*ret);
+    else co_return std::nullopt;
+}
+
 }
\ No newline at end of file
@@ -1,18 +1,30 @@
 #pragma once
 
 #include <coroutine>
+#include <utilities/frame_allocator.hpp>
 
 namespace co_async {
 
+// 子协程结束的时候不直接回到mPrevious, 而是调用mResume, 由它决定接下来resume谁
+// when_all/when_any把它放在父协程的帧里, 子任务结束的时候直接更新计数, 不用再给每个子任务包一层协程
+struct Continuation {
+    std::coroutine_handle<> (*mResume)(Continuation &) noexcept;
+};
+
 struct PreviousAwaiter {
 
     std::coroutine_handle<> mPrevious{};
+    // 只有final_suspend会传
+    Continuation *mContinuation = nullptr;
 
     bool await_ready() const noexcept { return false; }
     // 这里返回类型设置为coroutine_handle是为了避免手动再次resume
     // 如果一个协程yield,并且await_ready为false就会执行下面这个函数,如果这个函数返回void,就表示
     // 直接将这个协程挂起,将控制权交给协程调用者,也可以设置返回值执行其他协程
+    // 结束或者yield, 把当前arena清掉, 回到的父协程会换成它自己的
     std::coroutine_handle<> await_suspend(std::coroutine_handle<>) const noexcept {
+        FrameArena::current() = nullptr;
+        if (mContinuation) return mContinuation->mResume(*mContinuation);
         if (mPrevious) return mPrevious;
         else return std::noop_coroutine(); // void 一样的效果(一次一停顿,需要调用者不断resume)
     }
@@ -2,15 +2,17 @@
 
 #include <exception>
 #include <coroutine>
+#include <stop_token>
+#include <utilities/frame_allocator.hpp>
 #include "task.hpp"
 
 namespace co_async {
 
 // mCoroutine.promise()->mPrevious
 // Promise是协程句柄的成员
-struct ReturnPreviousPromise {
+struct ReturnPreviousPromise : PooledFrame {
     auto initial_suspend() noexcept {
-        return std::suspend_always();
+        return enterArena();
     }
 
     auto final_suspend() noexcept {
@@ -58,6 +60,8 @@ struct ReturnPreviousPromise {
     }
 
     std::coroutine_handle<> mPrevious;
+    // when_all/when_any给每个子任务设置, 子任务co_await的时候继承下去
+    std::stop_token mStopToken{};
 
     ReturnPreviousPromise &operator=(ReturnPreviousPromise &&) = delete;
 };
@@ -0,0 +1,193 @@
+/**
+ * @file runtime.hpp
+ * @author qc
+ * @brief 每个核一个线程的分片运行时(thread-per-core)
+ * @details 一个进程起N个工作线程,每个线程绑定到一个核上,拥有自己的AsyncLoop(自己的epoll,定时器,就绪队列)
+ *          线程之间什么都不共享,所以不需要加锁
+ *          做服务器的时候每个线程各自用SO_REUSEPORT监听同一个端口,内核按四元组哈希把新连接分给其中一个,
+ *          连接从accept开始到关闭都留在同一个核上,缓存友好
+ *          任何一个线程失败(比如bind失败), 整个运行时都停下来, 由run()抛出第一个异常
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <exception>
+#include <cstddef>
+#include <system_error>
+#include "task.hpp"
+#include "asyncLoop.hpp"
+#include "socket.hpp"
+
+namespace co_async {
+
+struct Runtime {
+    // nthreads为0就用核数
+    explicit Runtime(std::size_t nthreads = 0, bool pinCores = true)
+        : mThreadCount(nthreads ? nthreads : std::max(1u, std::thread::hardware_concurrency())),
+          mPinCores(pinCores) {}
+
+    std::size_t size() const noexcept {
+        return mThreadCount;
+    }
+
+    // 每个工作线程上执行 co_await entry(loop, index), 所有线程都结束了才返回
+    // entry必须返回Task<void>; 任何一个线程抛出异常, 其他线程的loop都会停下来(没跑完的entry和co_spawn出去的任务直接丢掉),
+    // 第一个异常在这里重新抛出
+    template <class F>
+    void run(F &&entry) {
+        RunState state(mThreadCount);
+        std::vector<std::jthread> threads;
+        threads.reserve(mThreadCount);
+        for (std::size_t i = 0; i < mThreadCount; ++i) {
+            threads.emplace_back([this, i, &entry, &state] {
+                try {
+                    if (mPinCores) pinToCore(i);
+                    AsyncLoop loop;
+                    RunState::Attach attach(state, i, loop);
+                    if (state.stopping()) return;
+                    Task<void> t = entry(loop, i);
+                    auto a = t.operator co_await();
+                    a.await_suspend(std::noop_coroutine()).resume();
+                    while (!state.stopping() && loop.tryRun());
+                    if (!state.stopping() || t.mCoroutine.done()) a.await_resume();
+                } catch (...) {
+                    state.fail(std::current_exception());
+                }
+            });
+        }
+        threads.clear();
+        if (state.mError) std::rethrow_exception(state.mError);
+    }
+
+    // 每个线程一个SO_REUSEPORT监听套接字, 每个连接co_spawn handler(loop, conn)到接收它的线程上
+    // handler返回Task<void>; handler结束(或者抛异常)之后由serve关闭连接(close_file), handler自己不要关
+    template <class F>
+    void serve(SocketAddress const& addr, F &&handler) {
+        run([&](AsyncLoop &loop, std::size_t) -> Task<void> {
+            // 监听和accept走epoll(定义了CO_ASYNC_USE_IO_URING的时候AsyncLoop两种loop都能转换, 要指明)
+            IoLoop &ioLoop = loop;
+            AsyncFile serv = co_await create_tcp_server(ioLoop, addr, true);
+            auto backoff = kAcceptBackoffMin;
+            while (true) {
+                AsyncFile conn;
+                int error = 0;
+                try {
+                    conn = std::get<0>(co_await socket_accept<SocketAddress>(ioLoop, serv));
+                } catch (std::system_error const &e) {
+                    error = e.code().value();
+                }
+                if (error) {
+                    // fd或者内存用完了: 连接还在backlog里, 等一会儿(越等越久)再试, 这期间已有的连接可以关掉一些
+                    if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM) {
+                        co_await sleep_for(loop, backoff);
+                        backoff = std::min(backoff * 2, kAcceptBackoffMax);
+                        continue;
+                    }
+                    // 对端在accept之前就断开了之类的, 只影响这一个连接
+                    if (error == ECONNABORTED || error == EINTR || error == EPROTO || error == EPERM)
+                        continue;
+                    throw std::system_error(error, std::system_category(), "accept");
+                }
+                backoff = kAcceptBackoffMin;
+                co_spawn(loop, serveConnection(loop, handler, std::move(conn)));
+            }
+        });
+    }
+
+private:
+    static constexpr std::chrono::milliseconds kAcceptBackoffMin{10};
+    static constexpr std::chrono::milliseconds kAcceptBackoffMax{1000};
+
+    // 一次run()里所有工作线程共享: 第一个异常, 以及停下来的时候要叫醒的每个线程的loop
+    struct RunState {
+        explicit RunState(std::size_t n) : mLoops(n) {}
+
+        // 工作线程的loop活着的期间登记在这里
+        struct Attach {
+            Attach(RunState &state, std::size_t i, AsyncLoop &loop) : mState(state), mIndex(i) {
+                std::lock_guard lock(mState.mMutex);
+                mState.mLoops[mIndex] = &loop;
+            }
+
+            Attach(Attach &&) = delete;
+
+            ~Attach() {
+                std::lock_guard lock(mState.mMutex);
+                mState.mLoops[mIndex] = nullptr;
+            }
+
+            RunState &mState;
+            std::size_t mIndex;
+        };
+
+        bool stopping() const noexcept {
+            return mStopping.load(std::memory_order_acquire);
+        }
+
+        // 记下第一个异常, 叫醒所有阻塞在epoll_wait里的loop, 它们看到stopping()就退出
+        void fail(std::exception_ptr e) {
+            std::lock_guard lock(mMutex);
+            if (!mError) mError = e;
+            mStopping.store(true, std::memory_order_release);
+            for (auto *loop : mLoops)
+                if (loop) static_cast<IoLoop &>(*loop).wakeup();
+        }
+
+        std::mutex mMutex;
+        std::vector<AsyncLoop *> mLoops;
+        std::exception_ptr mError;
+        std::atomic<bool> mStopping{false};
+    };
+
+    template <class F>
+    static Task<void> serveConnection(AsyncLoop &loop, F &handler, AsyncFile conn) {
+        std::exception_ptr e;
+        try {
+            co_await handler(loop, AsyncFile(conn));
+        } catch (...) {
+            e = std::current_exception();
+        }
+        close_file(static_cast<IoLoop &>(loop), conn);
+        if (e) std::rethrow_exception(e);
+    }
+
+    // 第i个worker绑到允许使用的CPU里的第i个(taskset/cpuset限制之后CPU编号不一定从0连续)
+    // 新线程继承了创建它的线程的亲和性, 所以这里查到的就是整个进程被允许的集合
+    void pinToCore(std::size_t i) const {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        // 查不到或者绑核失败(比如被cgroup限制)都不影响正确性, 不绑就是了
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) return;
+        int count = CPU_COUNT(&allowed);
+        if (count == 0) return;
+        std::size_t nth = i % (std::size_t)count;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (!CPU_ISSET(cpu, &allowed)) continue;
+            if (nth-- != 0) continue;
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            return;
+        }
+    }
+
+    std::size_t mThreadCount;
+    bool mPinCores;
+};
+
+}
@@ -47,6 +47,20 @@ struct Loop {
         mReadyQueue.push_back(task);
     }
 
+    bool hasTask() const noexcept {
+        return !mReadyQueue.empty();
+    }
+
+    // 只执行调用时已经在队列里的任务, 执行过程中新加进来的留到下一轮
+    // 这样一个不停把自己加回队列的协程也不会饿死定时器和IO
+    void runOnce() {
+        for (std::size_t n = mReadyQueue.size(); n > 0; --n) {
+            auto t = mReadyQueue.front();
+            mReadyQueue.pop_front();
+            t.resume();
+        }
+    }
+
     void process() {
         while (!mReadyQueue.empty()) {
             while (!mReadyQueue.empty()) {
@@ -91,8 +105,9 @@ struct Loop {
 // 函数中的static Loop loop; 生命周期为整个程序,作用域是getLoop()
 // 懒汉式,只有调用这个函数的时候才会初始化,函数前面的static为了减小程序大小可以不加,要不然每个源文件都有一个这个函数
 // 这里也不是成员函数,所以没必要在函数前面加上static
+// thread_local: 多线程运行时(runtime.hpp)中每个线程都有自己的一份
 static Loop* getLoop() {
-    static Loop loop;
+    static thread_local Loop loop;
     return &loop;
 }
 
@@ -160,25 +160,30 @@ inline void socketSetOption(AsyncFile &sock, int level, int opt, T const &optVal
     checkError(setsockopt(sock.fileNo(), level, opt, &optVal, sizeof(optVal)));
 }
 
-inline Task<void> socketConnect(IoLoop &loop, AsyncFile &sock, SocketAddress const& addr) {
+// deadline: 到了还没连上就抛ETIMEDOUT
+inline Task<void> socketConnect(IoLoop &loop, AsyncFile &sock, SocketAddress const& addr,
+                                std::optional<TimerLoop::Clock::time_point> deadline = std::nullopt) {
     sock.setNonblock();
     int res = chechErrorNonBlock(connect(sock.fileNo(), (sockaddr *)&addr.mAddr, addr.mAddrLen), -1, EINPROGRESS);
 
     // -1 并且errno 为 EINPROGRESS表示正在连接,添加写事件,等待触发,之后判断
     if (res == -1) [[likely]] {
-        co_await wait_file_event(loop, sock, EPOLLOUT);
+        co_await wait_file_event(loop, sock, EPOLLOUT, deadline);
         // 检测SO_ERROR 如果没有错误就返回0
         int err = socketGetOption<int>(sock, SOL_SOCKET, SO_ERROR);
         if (err != 0) [[unlikely]] {
             throw std::system_error(err, std::system_category(), "connect");
         }
+        // 连上之后socket仍然可写,ET模式下不会再通知,把EPOLLOUT放回去
+        loop.markReady(sock, EPOLLOUT);
     }
 }
 
 inline
-Task<AsyncFile> create_tcp_client(IoLoop &loop, SocketAddress const& addr) {
+Task<AsyncFile> create_tcp_client(IoLoop &loop, SocketAddress const& addr,
+                                  std::optional<TimerLoop::Clock::time_point> deadline = std::nullopt) {
     AsyncFile sock(socket(addr.mAddr.ss_family, SOCK_STREAM, 0));
-    co_await socketConnect(loop, sock, addr);
+    co_await socketConnect(loop, sock, addr, deadline);
     co_return sock; // return_val中以val的方式传递,或者右值引用
 }
 
@@ -187,24 +192,22 @@ void socket_listen(AsyncFile &sock, int backlog = SOMAXCONN) {
     checkError(listen(sock.fileNo(), backlog));
 }
 
-// 
+// reusePort: 多个线程各自bind同一个端口,由内核把新连接分给不同的监听套接字(SO_REUSEPORT)
 inline
-Task<void> socketBind(IoLoop &loop, AsyncFile &sock, SocketAddress const& addr, int backlog = SOMAXCONN) {
+Task<void> socketBind(IoLoop &loop, AsyncFile &sock, SocketAddress const& addr, int backlog = SOMAXCONN, bool reusePort = false) {
     sock.setNonblock();
+    // SO_REUSEADDR/SO_REUSEPORT 必须在bind之前设置才有用
+    socketSetOption<int>(sock, SOL_SOCKET, SO_REUSEADDR, 1);
+    if (reusePort)
+        socketSetOption<int>(sock, SOL_SOCKET, SO_REUSEPORT, 1);
     // 一般绑定的时候不判断EINPROGRESS
     checkError(bind(sock.fileNo(), (sockaddr const*)&addr.mAddr, addr.mAddrLen));
-    PRINT_S(绑定成功);
-    
+
     // co_await wait_file_event(loop, sock, EPOLLOUT);
     // int err = socketGetOption<int>(sock, SOL_SOCKET, SO_ERROR);
     // if (err != 0) [[unlikely]] {
     //     throw std::system_error(err, std::system_category(), "bind");
     // }
-    // 设置非阻塞
-    int optVal = 0;
-    socketSetOption<int>(sock, SOL_SOCKET, SO_REUSEADDR, optVal);
-    
-    PRINT_S(开始监听);
     socket_listen(sock, backlog);
 
     // co_await wait_file_event(loop, sock, EPOLLIN);
@@ -213,9 +216,9 @@ Task<void> socketBind(IoLoop &loop, AsyncFile &sock, SocketAddress const& addr,
 }
 
 inline
-Task<AsyncFile> create_tcp_server(IoLoop &loop, SocketAddress const& addr) {
-    AsyncFile sock(socket(addr.mAddr.ss_family, SOCK_STREAM, 0));
-    co_await socketBind(loop, sock, addr);
+Task<AsyncFile> create_tcp_server(IoLoop &loop, SocketAddress const& addr, bool reusePort = false) {
+    AsyncFile sock(checkError(socket(addr.mAddr.ss_family, SOCK_STREAM, 0)));
+    co_await socketBind(loop, sock, addr, SOMAXCONN, reusePort);
     co_return sock;
 }
 
@@ -225,15 +228,24 @@ void socket_shutdown(AsyncFile &sock, int flags = SHUT_RDWR) {
     checkError(shutdown(sock.fileNo(), flags));
 }
 
+// deadline: 到了还没有新连接就抛ETIMEDOUT
 template <class AddrType>
-inline Task<std::tuple<AsyncFile, AddrType>> socket_accept(IoLoop &loop, AsyncFile &sock) {
+inline Task<std::tuple<AsyncFile, AddrType>> socket_accept(IoLoop &loop, AsyncFile &sock,
+                                                           std::optional<TimerLoop::Clock::time_point> deadline = std::nullopt) {
     AddrType addr;
-    socklen_t addrLen = sizeof(addr.mAddrLen);
-    // 这里是触发了事件才返回的,要不然就一直阻塞, 这行的下一行才触发任务的,怎么返回??
-    // co_await wait_file_event(loop, sock, EPOLLIN);
-    int rt = checkError(accept(sock.fileNo(), (sockaddr *)&addr.mAddr, &addrLen));
-
-    co_return {AsyncFile(rt), addr};
+    // 先直接accept, 没有连接(EAGAIN)再等EPOLLIN
+    bool tryNow = !loop.isDrained(sock, EPOLLIN);
+    while (true) {
+        if (tryNow) {
+            addr.mAddrLen = sizeof(addr.mAddr);
+            int rt = accept4(sock.fileNo(), (sockaddr *)&addr.mAddr, &addr.mAddrLen, SOCK_NONBLOCK);
+            if (rt != -1 || errno != EAGAIN)
+                co_return {AsyncFile(checkError(rt)), addr};
+            loop.markDrained(sock, EPOLLIN);
+        }
+        co_await wait_file_event(loop, sock, EPOLLIN, deadline);
+        tryNow = true;
+    }
 }
 
 }
@@ -1,63 +1,127 @@
 #pragma once
 
+#include <chrono>
 #include <span>
+#include <type_traits>
 #include <utility>
 #include <string>
 #include "ioLoop.hpp"
 #include "stream_base.hpp"
 #include "stdio.hpp"
+#include "uringLoop.hpp"
+#include "asyncLoop.hpp"
 
 namespace co_async {
 
-struct FileBuf {
-    IoLoop *mLoop;
+// Loop 可以是 IoLoop(epoll) 或者 IoUringLoop(io_uring), read_file/write_file 按loop类型重载
+template <class Loop>
+struct BasicFileBuf {
+    Loop *mLoop;
     AsyncFile mFile;
 
-    FileBuf(IoLoop &loop, AsyncFile &&file)
+    BasicFileBuf(Loop &loop, AsyncFile &&file)
         : mLoop(&loop),
           mFile(std::move(file)) {}
 
-    FileBuf() noexcept : mLoop(nullptr) {}
+    BasicFileBuf() noexcept : mLoop(nullptr) {}
 
     Task<std::size_t> read(std::span<char> buffer) {
         return read_file(*mLoop, mFile, buffer);
     }
 
+    Task<std::size_t> read(std::span<char> buffer, std::chrono::steady_clock::time_point deadline) {
+        return read_file(*mLoop, mFile, buffer, deadline);
+    }
+
     Task<std::size_t> write(std::span<char const> buffer) {
         return write_file(*mLoop, mFile, buffer);
     }
-};
 
-using FileIStream = IStream<FileBuf>;
-using FileOStream = OStream<FileBuf>;
-using FileStream = IOStream<FileBuf>;
+    Task<std::size_t> write(std::span<char const> buffer, std::chrono::steady_clock::time_point deadline) {
+        return write_file(*mLoop, mFile, buffer, deadline);
+    }
 
-struct StdioBuf {
-    IoLoop *mLoop;
+    Task<std::size_t> writev(std::span<struct iovec const> iov) {
+        return writev_file(*mLoop, mFile, iov);
+    }
+
+    Task<std::size_t> writev(std::span<struct iovec const> iov, std::chrono::steady_clock::time_point deadline) {
+        return writev_file(*mLoop, mFile, iov, deadline);
+    }
+
+    // 关闭fd(close_file), 连接/文件用完之后调用
+    void close() {
+        close_file(*mLoop, mFile);
+    }
+};
+
+template <class Loop>
+struct BasicStdioBuf {
+    Loop *mLoop;
     AsyncFile mFileIn;
     AsyncFile mFileOut;
 
-    StdioBuf(IoLoop &loop)
+    BasicStdioBuf(Loop &loop)
         : mLoop(&loop),
           mFileIn(async_stdin(true)),
           mFileOut(async_stdout()) {}
 
-    StdioBuf(IoLoop &loop, AsyncFile &&fileIn, AsyncFile &&fileOut)
+    BasicStdioBuf(Loop &loop, AsyncFile &&fileIn, AsyncFile &&fileOut)
         : mLoop(&loop),
           mFileIn(std::move(fileIn)),
           mFileOut(std::move(fileOut)) {}
 
-    StdioBuf() noexcept : mLoop(nullptr) {}
+    BasicStdioBuf() noexcept : mLoop(nullptr) {}
 
     Task<std::size_t> read(std::span<char> buffer) {
         return read_file(*mLoop, mFileIn, buffer);
     }
 
+    Task<std::size_t> read(std::span<char> buffer, std::chrono::steady_clock::time_point deadline) {
+        return read_file(*mLoop, mFileIn, buffer, deadline);
+    }
+
     Task<std::size_t> write(std::span<char const> buffer) {
         return write_file(*mLoop, mFileOut, buffer);
     }
+
+    Task<std::size_t> write(std::span<char const> buffer, std::chrono::steady_clock::time_point deadline) {
+        return write_file(*mLoop, mFileOut, buffer, deadline);
+    }
+
+    Task<std::size_t> writev(std::span<struct iovec const> iov) {
+        return writev_file(*mLoop, mFileOut, iov);
+    }
+
+    Task<std::size_t> writev(std::span<struct iovec const> iov, std::chrono::steady_clock::time_point deadline) {
+        return writev_file(*mLoop, mFileOut, iov, deadline);
+    }
+
+    // 关闭两个fd(close_file), 读写是同一个fd(比如socket)的时候只关一次
+    void close() {
+        if (mFileOut.fileNo() == mFileIn.fileNo()) mFileOut.releaseOwnership();
+        close_file(*mLoop, mFileIn);
+        close_file(*mLoop, mFileOut);
+    }
 };
 
+// 编译时选择默认后端: 定义了 CO_ASYNC_USE_IO_URING 就走io_uring
+// 构造时选择: 直接使用 BasicFileBuf<IoLoop> / BasicFileBuf<IoUringLoop>
+#if CO_ASYNC_USE_IO_URING
+using DefaultIoLoop = IoUringLoop;
+#else
+using DefaultIoLoop = IoLoop;
+#endif
+// 默认后端必须由AsyncLoop驱动, 流类型才能直接用AsyncLoop构造
+static_assert(std::is_convertible_v<AsyncLoop &, DefaultIoLoop &>);
+
+using FileBuf = BasicFileBuf<DefaultIoLoop>;
+using StdioBuf = BasicStdioBuf<DefaultIoLoop>;
+
+using FileIStream = IStream<FileBuf>;
+using FileOStream = OStream<FileBuf>;
+using FileStream = IOStream<FileBuf>;
+
 using StdioStream = IOStream<StdioBuf>;
 
 struct StringReadBuf {
@@ -10,95 +10,197 @@
  */
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
 #include <concepts>
 #include <cstdint>
+#include <cstring>
 #include <span>
 #include <vector>
 #include <string>
 #include <utility>
 #include <optional>
 #include <memory>
+#include <system_error>
+#include <sys/uio.h>
+#include <utilities/frame_allocator.hpp>
 #include "task.hpp"
 
 namespace co_async {
 
 struct EOFException {};
 
+// 流操作的截止时间, 为空表示不限时
+using Deadline = std::optional<std::chrono::steady_clock::time_point>;
+
 /// @brief 输入流
 template <class Reader>
 struct IStreamBase {
-
-    explicit IStreamBase(std::size_t bufferSize = 8192) : mBuffer(std::make_unique<char[]>(bufferSize)), mBufSize(bufferSize) { }
+    // 缓冲区在当前arena里分配(有的话), 流跟着请求一起释放
+    explicit IStreamBase(std::size_t bufferSize = 8192) : mBuffer(makeArenaBuffer(bufferSize)), mBufSize(bufferSize) { }
 
     IStreamBase(IStreamBase &&) = default;
     IStreamBase &operator = (IStreamBase &&) = default;
 
-    Task<char> getChar() {
+    // deadline: 整个操作的截止时间(steady_clock), 到了还没读完就抛ETIMEDOUT
+    // 只有Reader的read支持deadline(比如FileBuf)才有用, 内存里的流不会阻塞, 直接忽略
+    Task<char> getChar(Deadline deadline = std::nullopt) {
         if (bufferEmpty()) {
-            co_await fillBuffer();
+            co_await fillBuffer(deadline);
         }
         char c = mBuffer[mIndex++];
         co_return c;
     }
 
-    Task<std::string> getLine(char eol = '\n') {
+    // 在缓冲区里用memchr找eol, 找到之前的整段一次追加进去, 缓冲区读完了才重新填
+    Task<std::string> getLine(char eol = '\n', Deadline deadline = std::nullopt) {
         std::string s;
         while (true) {
-            char c = co_await getChar();
-            if (c == eol) break;
-            s.push_back(c);
+            if (bufferEmpty())
+                co_await fillBuffer(deadline);
+            char const *begin = mBuffer.get() + mIndex;
+            std::size_t n = mEnd - mIndex;
+            if (auto *p = static_cast<char const *>(std::memchr(begin, eol, n))) {
+                s.append(begin, p);
+                mIndex += p - begin + 1;
+                break;
+            }
+            s.append(begin, n);
+            mIndex = mEnd;
         }
         co_return s;
     }
 
-    Task<std::string> getLine(std::string_view eol) {
+    // 多字节的分隔符(比如"\r\n", "\r\n\r\n"), 返回的内容不包括分隔符
+    // 分隔符可能被缓冲区边界切开: 重新填了缓冲区之后先拿已读内容的末尾几个字节接上新缓冲区的开头找一次
+    Task<std::string> getLine(std::string_view eol, Deadline deadline = std::nullopt) {
         std::string s;
         while (true) {
-            char c = co_await getchar();
-            if (c == eol[0]) {
-                std::size_t i;
-                for (i = 1; i < eol.size(); ++i) {
-                    char c = co_await getchar();
-                    if (c != eol[i]) {
-                        break;
-                    }
-                }
-                if (i == eol.size()) {
+            if (bufferEmpty())
+                co_await fillBuffer(deadline);
+            std::string_view buf(mBuffer.get() + mIndex, mEnd - mIndex);
+            if (!s.empty() && eol.size() > 1) {
+                std::size_t tail = std::min(s.size(), eol.size() - 1);
+                std::string joint(s.end() - tail, s.end());
+                joint.append(buf.substr(0, eol.size() - 1));
+                // 只要从s里开始的匹配, 完全在buf里的下面再找
+                if (auto q = joint.find(eol); q < tail) {
+                    s.resize(s.size() - tail + q);
+                    mIndex += q + eol.size() - tail;
                     break;
                 }
-                for (std::size_t j = 0; j < i; ++j) {
-                    s.push_back(eol[j]);
-                }
-                continue;
             }
-            s.push_back(c);
+            if (auto p = buf.find(eol); p != buf.npos) {
+                s.append(buf.substr(0, p));
+                mIndex += p + eol.size();
+                break;
+            }
+            s.append(buf);
+            mIndex = mEnd;
         }
         co_return s;
     }
 
-    Task<std::string> getN(std::size_t n) {
-        std::string s;
-        for (size_t i = 0; i < n; ++i) {
-            char c = co_await getChar();
-            s.push_back(c);
+    // 读满buffer为止, 中途EOF抛EOFException(已经读到的部分留在buffer里)
+    // 缓冲区里有的直接拷走, 剩下的比整个缓冲区还大就直接读进buffer, 不经过缓冲区
+    Task<void> read_exact(std::span<char> buffer, Deadline deadline = std::nullopt) {
+        std::size_t n = std::min(buffer.size(), mEnd - mIndex);
+        std::copy_n(mBuffer.get() + mIndex, n, buffer.data());
+        mIndex += n;
+        buffer = buffer.subspan(n);
+        while (buffer.size() >= mBufSize) {
+            n = co_await readSome(buffer, deadline);
+            if (n == 0) [[unlikely]]
+                throw EOFException();
+            buffer = buffer.subspan(n);
         }
+        while (!buffer.empty()) {
+            co_await fillBuffer(deadline);
+            n = std::min(buffer.size(), mEnd);
+            std::copy_n(mBuffer.get(), n, buffer.data());
+            mIndex = n;
+            buffer = buffer.subspan(n);
+        }
+    }
+
+    Task<std::string> getN(std::size_t n, Deadline deadline = std::nullopt) {
+        std::string s;
+        s.resize(n);
+        co_await read_exact(s, deadline);
         co_return s;
     }
 
+    // peek_until最多把缓冲区扩大到这么大
+    static constexpr std::size_t kMaxPeekSize = 1 << 20;
+
+    // 返回缓冲区里从当前位置到delim(包括delim)的视图, 不拷贝也不消费, 用完了调用consume(view.size())
+    // 视图只在下一次读这个流之前有效
+    // 还没找到就保留已有的内容接着读: 缓冲区满了先把没消费的挪到开头, 还是满的就扩大一倍, 超过maxSize抛EMSGSIZE
+    // 读到EOF还没找到抛EOFException, 已经读到的内容还留在缓冲区里
+    Task<std::string_view> peek_until(std::string_view delim, Deadline deadline = std::nullopt,
+                                      std::size_t maxSize = kMaxPeekSize) {
+        std::size_t scanned = 0;
+        while (true) {
+            std::string_view buf(mBuffer.get() + mIndex, mEnd - mIndex);
+            if (auto p = buf.find(delim, scanned); p != buf.npos)
+                co_return buf.substr(0, p + delim.size());
+            // 末尾不到delim.size()个字节可能是delim的前半截, 下次从这里开始找
+            if (buf.size() >= delim.size())
+                scanned = buf.size() - delim.size() + 1;
+            co_await fillMore(deadline, maxSize);
+        }
+    }
+
+    // 丢掉缓冲区里的前n个字节, n不能超过peek_until返回的视图的长度
+    void consume(std::size_t n) noexcept {
+        mIndex += n;
+    }
+
     bool bufferEmpty() const noexcept {
         return mIndex == mEnd;
     }
 
-    Task<void> fillBuffer() {
-        auto *that = static_cast<Reader *>(this);
+    Task<void> fillBuffer(Deadline deadline = std::nullopt) {
         mIndex = 0;
-        mEnd = co_await that->read(std::span(mBuffer.get(), mBufSize));
+        mEnd = co_await readSome(std::span(mBuffer.get(), mBufSize), deadline);
         if (mEnd == 0) [[unlikely]] 
             throw EOFException();
     }
 
 private:
-    std::unique_ptr<char[]> mBuffer;
+    // 和fillBuffer不同, 保留缓冲区里还没消费的内容, 新读到的接在后面
+    Task<void> fillMore(Deadline deadline, std::size_t maxSize) {
+        if (mEnd == mBufSize && mIndex != 0) {
+            std::copy(mBuffer.get() + mIndex, mBuffer.get() + mEnd, mBuffer.get());
+            mEnd -= mIndex;
+            mIndex = 0;
+        }
+        if (mEnd == mBufSize) {
+            if (mBufSize >= maxSize) [[unlikely]]
+                throw std::system_error(EMSGSIZE, std::system_category());
+            std::size_t size = std::min(mBufSize * 2, maxSize);
+            auto buffer = makeArenaBuffer(size);
+            std::copy_n(mBuffer.get(), mEnd, buffer.get());
+            mBuffer = std::move(buffer);
+            mBufSize = size;
+        }
+        std::size_t n = co_await readSome(std::span(mBuffer.get() + mEnd, mBufSize - mEnd), deadline);
+        if (n == 0) [[unlikely]]
+            throw EOFException();
+        mEnd += n;
+    }
+
+    Task<std::size_t> readSome(std::span<char> buf, Deadline deadline) {
+        auto *that = static_cast<Reader *>(this);
+        if constexpr (requires { that->read(buf, *deadline); }) {
+            if (deadline) return that->read(buf, *deadline);
+        }
+        return that->read(buf);
+    }
+
+    ArenaBuffer mBuffer;
     std::size_t mIndex = 0;
     std::size_t mEnd = 0;
     std::size_t mBufSize = 0;
@@ -108,7 +210,7 @@ private:
 template <class Writer>
 struct OStreamBase {
 
-    explicit OStreamBase(size_t bufferSize = 8192) : mBuffer(std::make_unique<char[]>(bufferSize)), mBufSize(bufferSize) {}
+    explicit OStreamBase(size_t bufferSize = 8192) : mBuffer(makeArenaBuffer(bufferSize)), mBufSize(bufferSize) {}
 
     OStreamBase(OStreamBase &&) = default;
     OStreamBase& operator = (OStreamBase &&) = default;
@@ -119,35 +221,135 @@ struct OStreamBase {
         mBuffer[mIndex++] = c;
     }
 
+    // 整段拷进缓冲区, 只在满了的时候flush
+    // 比整个缓冲区还大的不拷了, 借用它和缓冲区里已有的内容一起writev出去
     Task<void> puts(std::string_view s) {
-        for (char c : s) 
-            co_await putChar(c);
+        if (s.size() >= mBufSize) {
+            co_await putBorrowed(s);
+            co_await flush();
+            co_return;
+        }
+        while (true) {
+            std::size_t n = std::min(s.size(), mBufSize - mIndex);
+            std::copy_n(s.data(), n, mBuffer.get() + mIndex);
+            mIndex += n;
+            s.remove_prefix(n);
+            if (s.empty()) break;
+            co_await flush();
+        }
+    }
+
+    // 借用一段数据(比如响应的body), 不拷进缓冲区, flush的时候和缓冲区里的内容(比如响应头)一起用一次writev写出去
+    // 调用者要保证data一直有效, 直到下一次flush结束
+    // 很短的段直接拷进缓冲区, 比多一个iovec划算
+    Task<void> putBorrowed(std::span<char const> data) {
+        if (data.size() <= kCopyThreshold && mBufSize - mIndex >= data.size()) {
+            std::memcpy(mBuffer.get() + mIndex, data.data(), data.size());
+            mIndex += data.size();
+            co_return;
+        }
+        // 缓冲区里还没进链的部分一段, 借来的一段, 再给flush时缓冲区的尾巴留一段
+        if (mChainSize + 3 > kMaxChain)
+            co_await flush();
+        chainBuffered();
+        mChain[mChainSize++] = {const_cast<char *>(data.data()), data.size()};
     }
 
     bool bufferFull() const noexcept {
-        return mIndex = mBufSize;
+        return mIndex == mBufSize;
     }
 
-    Task<void> flush() {
-        if (mIndex) [[likely]] {
-            auto *that = static_cast<Writer*>(this);
+    // deadline: 到了还没全部写出去就抛ETIMEDOUT, 没写出去的部分还留在缓冲区(和借用链)里, 再flush接着写
+    Task<void> flush(Deadline deadline = std::nullopt) {
+        if (mChainSize) {
+            co_await flushChain(deadline);
+        } else if (mIndex) [[likely]] {
             auto buf = std::span(mBuffer.get(), mIndex);
-            auto len = co_await that->write(buf);
+            auto len = co_await writeSome(buf, deadline);
             while (len != buf.size()) [[unlikely]] {
+                if (len == 0) [[unlikely]]
+                    throw EOFException();
                 buf = buf.subspan(len);
-                len = co_await that->write(buf);
+                len = co_await writeSome(buf, deadline);
             }
-            if (len == 0) [[unlikely]] 
-                throw EOFException();
             mIndex = 0;
         }
     }
 
 private:
-    std::unique_ptr<char[]> mBuffer;
+    static constexpr std::size_t kMaxChain = 16;
+    static constexpr std::size_t kCopyThreshold = 256;
+
+    // 缓冲区里[mChained, mIndex)这部分接到链上; 和链上最后一段在缓冲区里是连着的就直接合并
+    void chainBuffered() noexcept {
+        if (mIndex == mChained) return;
+        char *begin = mBuffer.get() + mChained;
+        if (mChainSize) {
+            iovec &last = mChain[mChainSize - 1];
+            if ((char *)last.iov_base + last.iov_len == begin) {
+                last.iov_len += mIndex - mChained;
+                mChained = mIndex;
+                return;
+            }
+        }
+        mChain[mChainSize++] = {begin, mIndex - mChained};
+        mChained = mIndex;
+    }
+
+    // 部分写可能停在任何一段的中间: 写完的段跳过, 写了一半的段原地调整, 超时之后再flush从这里接着写
+    Task<void> flushChain(Deadline deadline) {
+        chainBuffered();
+        while (mChainBegin != mChainSize) {
+            auto iov = std::span<iovec const>(mChain.data() + mChainBegin, mChainSize - mChainBegin);
+            std::size_t len = co_await writevSome(iov, deadline);
+            if (len == 0) [[unlikely]]
+                throw EOFException();
+            while (mChainBegin != mChainSize && len >= mChain[mChainBegin].iov_len) {
+                len -= mChain[mChainBegin].iov_len;
+                ++mChainBegin;
+            }
+            if (len) {
+                iovec &part = mChain[mChainBegin];
+                part.iov_base = (char *)part.iov_base + len;
+                part.iov_len -= len;
+            }
+        }
+        mChainSize = 0;
+        mChainBegin = 0;
+        mChained = 0;
+        mIndex = 0;
+    }
+
+    Task<std::size_t> writeSome(std::span<char const> buf, Deadline deadline) {
+        auto *that = static_cast<Writer*>(this);
+        if constexpr (requires { that->write(buf, *deadline); }) {
+            if (deadline) return that->write(buf, *deadline);
+        }
+        return that->write(buf);
+    }
+
+    // Writer没有writev(比如StringWriteBuf)就一次写一段
+    Task<std::size_t> writevSome(std::span<iovec const> iov, Deadline deadline) {
+        auto *that = static_cast<Writer*>(this);
+        if constexpr (requires { that->writev(iov); }) {
+            if constexpr (requires { that->writev(iov, *deadline); }) {
+                if (deadline) return that->writev(iov, *deadline);
+            }
+            return that->writev(iov);
+        } else {
+            return writeSome(std::span((char const *)iov[0].iov_base, iov[0].iov_len), deadline);
+        }
+    }
+
+    ArenaBuffer mBuffer;
     size_t mIndex = 0;
     size_t mEnd = 0;
     size_t mBufSize = 0;
+    // 借用链: [mChainBegin, mChainSize)还没写出去, 缓冲区里[0, mChained)已经在链上了
+    std::array<iovec, kMaxChain> mChain;
+    std::size_t mChainSize = 0;
+    std::size_t mChainBegin = 0;
+    std::size_t mChained = 0;
 };
 
 
@@ -185,7 +387,7 @@ struct [[nodiscard]] OStream : OStreamBase<OStream<StreamBuf>>, StreamBuf {
 };
 
 template <class StreamBuf>
-struct [[nodiscard]] IStream : IStreamBase<OStream<StreamBuf>>, StreamBuf {
+struct [[nodiscard]] IStream : IStreamBase<IStream<StreamBuf>>, StreamBuf {
     template <class... Args>
         requires std::constructible_from<StreamBuf, Args...>
     explicit IStream(Args &&...args)
@@ -11,8 +11,11 @@
 #pragma once
 #include <exception> // for std::exception_ptr
 #include <coroutine>
+#include <memory_resource>
+#include <stop_token>
 #include <utility>
 #include <utilities/qc.hpp>
+#include <utilities/frame_allocator.hpp>
 #include <utilities/uninitialized.hpp>
 #include <utilities/non_void_helper.hpp>
 #include "concepts.hpp"
@@ -21,16 +24,17 @@
 /// @brief C++20协程中有很多硬编码函数xxx_xxx() -> 涉及到concept
 namespace co_async {
 
+// 协程帧从FramePool(线程局部的空闲链表)分配, 见frame_allocator.hpp
 template <class T>
-struct Promise {
+struct Promise : PooledFrame {
     auto initial_suspend() noexcept{
-        return std::suspend_always();
+        return enterArena();
     }
 
     auto final_suspend() noexcept {
         // 这里实现了递归调用协程,保存一个mPrevious协程句柄,等待co_return的时候执行mPrevious
         // 如果返回std::suspend_always()就会回到主线程
-        return PreviousAwaiter(mPrevious);
+        return PreviousAwaiter(mPrevious, mContinuation);
     }
 
     void unhandled_exception() noexcept {
@@ -75,7 +79,11 @@ struct Promise {
     // 作为一个promise,要记录我的调用者是谁,我的异常,我的协程返回值
     // 这里的mPreivous是通过Task中的Awaiter->await_suspend传入的
     std::coroutine_handle<> mPrevious{};
+    // when_all/when_any直接挂上来的子任务, 结束的时候调用它而不是回到mPrevious
+    Continuation *mContinuation = nullptr;
     std::exception_ptr mException{};
+    // 取消信号, co_await的时候从调用者那里继承下来, 一路传到最底层的IoFileAwaiter/SleepAwaiter
+    std::stop_token mStopToken{};
     // union {
     //     T mResult;
     // };
@@ -88,14 +96,14 @@ struct Promise {
 
 // 给返回类型为void的单独整一份
 template <>
-struct Promise<void> {
+struct Promise<void> : PooledFrame {
     auto initial_suspend() noexcept {
-        return std::suspend_always();
+        return enterArena();
     }
 
     auto final_suspend() noexcept {
         // 这里实现了递归调用协程,保存一个mPrevious协程句柄,等待co_return的时候执行mPrevious
-        return PreviousAwaiter(mPrevious);
+        return PreviousAwaiter(mPrevious, mContinuation);
     }
 
     void unhandled_exception() noexcept {
@@ -127,7 +135,9 @@ struct Promise<void> {
 
     // 作为一个promise,要记录我的调用者是谁,我的异常,我的协程返回值
     std::coroutine_handle<> mPrevious{};
+    Continuation *mContinuation = nullptr;
     std::exception_ptr mException{};
+    std::stop_token mStopToken{};
 
     // 作为一个Promise,不应该移动和拷贝
     // 除了构造函数其它五个也删除了,小技巧
@@ -168,11 +178,17 @@ struct Task {
         bool await_ready() const noexcept { return false; }
         // 如果没有准备好,就来下面,挂起,保存previous,继续执行自己
         // 这里的std::coroutine_handle<void> 类型擦除相当于std::any
-        std::coroutine_handle<promise_type> await_suspend(std::coroutine_handle<> coroutine) {
+        // 调用者的Promise里有取消信号(mStopToken)就传给被调用者, 这样when_any取消的时候整条调用链都能收到
+        template <class CallerPromise>
+        std::coroutine_handle<promise_type> await_suspend(std::coroutine_handle<CallerPromise> coroutine) {
             // 如果存在递归调用,并且没有记录上一个协程句柄,那么当前协程执行完就会返回到主线程
             // x86架构是将返回地址推入栈,这里是直接记录
             promise_type &promise = mCoroutine.promise();
             promise.mPrevious = coroutine;
+            if constexpr (requires { coroutine.promise().mStopToken; }) {
+                if (!promise.mStopToken.stop_possible())
+                    promise.mStopToken = coroutine.promise().mStopToken;
+            }
             return mCoroutine;
         }
         // 子协程执行完父协程会调用这个函数,如果子协程有一样,那么在这里会rethrow
@@ -201,6 +217,28 @@ struct Task {
 
 };
 
+// auto token = co_await get_stop_token(); 拿到当前协程的取消信号, 不会挂起
+// 自己写的长循环可以隔一会儿看一下token.stop_requested()
+struct GetStopTokenAwaiter {
+    bool await_ready() const noexcept { return false; }
+
+    template <class P>
+    bool await_suspend(std::coroutine_handle<P> coroutine) noexcept {
+        mToken = coroutine.promise().mStopToken;
+        return false;
+    }
+
+    std::stop_token await_resume() noexcept {
+        return std::move(mToken);
+    }
+
+    std::stop_token mToken{};
+};
+
+inline GetStopTokenAwaiter get_stop_token() noexcept {
+    return {};
+}
+
 template <class Loop, class T, class P>
 T run_task(Loop &loop, Task<T, P> const& t) {
     auto a = t.operator co_await();
@@ -209,4 +247,16 @@ T run_task(Loop &loop, Task<T, P> const& t) {
     return a.await_resume();
 }
 
+// t里面创建的协程帧(以及它们的结果, 流缓冲区)都从arena分配, t结束之后arena.release()一次性释放
+// t自己的帧已经分配好了, 不在arena里. 限制见asyncLoop.hpp里co_spawn的arena版本
+template <class Loop, class T, class P>
+T run_task(Loop &loop, std::pmr::monotonic_buffer_resource &arena, Task<T, P> const& t) {
+    t.mCoroutine.promise().mArena = &arena;
+    auto a = t.operator co_await();
+    a.await_suspend(std::noop_coroutine()).resume();
+    loop.process();
+    arena.release();
+    return a.await_resume();
+}
+
 }
\ No newline at end of file
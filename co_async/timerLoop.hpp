@@ -11,76 +11,190 @@
  */
 #pragma once
 
+#include <atomic>
 #include <coroutine>
 #include <optional>
+#include <cerrno>
 #include <chrono>
+#include <stop_token>
+#include <system_error>
 #include <thread>
+#include <type_traits>
+#include <utility>
+#include <time.h>
 
 #include <utilities/qc.hpp>
 #include <utilities/rbtree.hpp>
+#include <utilities/mpsc_queue.hpp>
 #include "task.hpp"
 #include "scheduler.hpp"
+#include "timing_wheel.hpp"
 
 using namespace std::chrono_literals;
 namespace co_async {
 
 // 定时器不需要返回任何value 直接继承Promise<void>即可
-// 这里Pomise直接继承 RbNode称为其儿子,RbNode从树中删除,对应的Promise也被删除
-struct SleepUntilPromise : RbTree<SleepUntilPromise>::RbNode, Promise<void> {
-    // 记录触发时间点,Promise<T>中不会记录
-    std::chrono::system_clock::time_point mExpireTime;
-
+// 这里Pomise直接继承 TimerNode(里面有RbNode和时间轮的链表节点),节点从树/轮子中删除,对应的Promise也被删除
+// Promise析构的时候(比如when_any中输掉被销毁)也会自动从树/轮子上摘下来
+struct SleepUntilPromise : TimerNode, Promise<void> {
     auto get_return_object() {
         return std::coroutine_handle<SleepUntilPromise>::from_promise(*this);
     }
 
     SleepUntilPromise& operator=(SleepUntilPromise &&) = delete;
-private:
-    bool operator > (SleepUntilPromise const& that) {
-        return this->mExpireTime > that.mExpireTime;
-    }
-
-    friend bool operator < (SleepUntilPromise const& lhs, SleepUntilPromise const& rhs) noexcept {
-        return lhs.mExpireTime < rhs.mExpireTime;
-    }
+};
 
+// 定时器的存放方式, 每个TimerLoop构造的时候选一个
+// RbTree: 精确到纳秒, 插入删除O(log n), 定时器不多的时候用
+// Wheel: 分层时间轮, 插入删除O(1), 精度是一个tick(1ms), 大量连接各带一个空闲超时/每个包都重置超时的时候用
+enum class TimerBackend {
+    RbTree,
+    Wheel,
 };
 
 struct TimerLoop {
+    // 定时器统一用单调时钟, 系统时间被NTP往回/往前拨的时候超时不会乱
+    using Clock = std::chrono::steady_clock;
+
+    explicit TimerLoop(TimerBackend backend = TimerBackend::RbTree) : mBackend(backend) {
+        if (mBackend == TimerBackend::Wheel) mWheel.emplace(now());
+    }
+
+    // 别的线程上发起的取消(比如工作窃取调度器上when_any的赢家在另一个线程结束), 节点由发起方提供
+    // TimerLoop不是线程安全的, 不能直接去改树/轮子, 先放进队列, 由驱动它的线程在run()开头处理
+    struct RemoteCancel {
+        RemoteCancel *mNext{};
+        TimerNode *mNode{};
+    };
+
     // weak RbTree,只保留一个引用指向真正的Promise
     // 这里澄清一下
     // Task是协程任务 eg Task<void> task { ... co_return }
     // auto t = task; 这个表示生成一个协程任务实例(Promise),但是还没有执行
     // 之后将这个t添加到调度器中,通过调度器t->mCoroutine.resume() 才表示真正执行协程函数.
-    RbTree<SleepUntilPromise> mRbTimer;
+    RbTree<TimerNode> mRbTimer;
+    std::optional<TimingWheel> mWheel;
+    TimerBackend mBackend;
+
+    TimerBackend backend() const noexcept {
+        return mBackend;
+    }
+
+    // 当前时间, 每一轮只真正读一次时钟, 之后都用缓存的值
+    // run()结束的时候和IoLoop从epoll_wait醒来的时候缓存失效, 下一次调用再重新读
+    // 所以同一轮里的sleep_for都是相对这一轮开始的时间算的(和libuv的uv_now一样)
+    Clock::time_point now() noexcept {
+        if (!mNowValid) updateNow();
+        return mNow;
+    }
+
+    void updateNow() noexcept {
+        if (mCoarseClock) {
+            // CLOCK_MONOTONIC_COARSE和steady_clock是同一个起点, 只是精度是一个jiffy(1~4ms), 不用进vDSO算TSC
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+            mNow = Clock::time_point(std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec));
+        } else {
+            mNow = Clock::now();
+        }
+        mNowValid = true;
+    }
+
+    void invalidateNow() noexcept {
+        mNowValid = false;
+    }
+
+    // 用粗粒度的单调时钟, 定时器大多是秒级超时的时候更省
+    void setCoarseClock(bool coarse) noexcept {
+        mCoarseClock = coarse;
+        mNowValid = false;
+    }
 
     bool hasTimer() const noexcept {
-        return !mRbTimer.empty();
+        return mWheel ? !mWheel->empty() : !mRbTimer.empty();
+    }
+
+    void addTimer(TimerNode &node) {
+        if (mWheel) {
+            mWheel->insert(node);
+        } else {
+            if (node.mSlack > mMaxSlack) mMaxSlack = node.mSlack;
+            mRbTimer.insert(node);
+        }
+    }
+
+    void removeTimer(TimerNode &node) {
+        // 已经被run()摘下来准备触发的节点不在树/轮子上, 什么都不做
+        if (mWheel) mWheel->erase(node);
+        else if (mRbTimer.contains(node)) mRbTimer.erase(node);
+    }
+
+    // 还挂在树/轮子上, 没有到期也没有被收走
+    bool containsTimer(TimerNode const &node) const noexcept {
+        return mWheel ? mWheel->contains(node) : mRbTimer.contains(node);
+    }
+
+    // 让node在下一次run()的时候马上触发; 已经不在树/轮子上(到期了正在触发)就什么都不做
+    void expireNow(TimerNode &node) {
+        if (!containsTimer(node)) return;
+        removeTimer(node);
+        node.mExpireTime = Clock::time_point::min();
+        node.mSlack = {};
+        addTimer(node);
+    }
+
+    // 当前线程是不是驱动这个TimerLoop的线程(构造它的线程, 之后是最近一次调用run()的线程)
+    bool isOwnerThread() const noexcept {
+        return mOwner.load(std::memory_order_relaxed) == std::this_thread::get_id();
+    }
+
+    // 驱动它的线程阻塞的时候怎么叫醒(AsyncLoop写eventfd, 工作线程唤醒条件变量), 跨线程取消之后调用
+    void setWakeup(void *ctx, void (*wakeup)(void *)) noexcept {
+        mWakeCtx = ctx;
+        mWakeFn = wakeup;
+    }
+
+    // 任何线程都可以调用, 让node在驱动线程上马上到期; node要活到驱动线程处理完(drainRemote)
+    void postCancel(RemoteCancel &cancel) {
+        mRemoteCancels.push(&cancel);
+        if (mWakeFn) mWakeFn(mWakeCtx);
     }
 
-    void addTimer(SleepUntilPromise &promise) {
-        mRbTimer.insert(promise);
+    bool hasRemote() const noexcept {
+        return !mRemoteCancels.empty();
+    }
+
+    // 只能在驱动线程上调用
+    void drainRemote() {
+        for (auto *cancel = mRemoteCancels.popAll(); cancel;) {
+            auto *next = cancel->mNext;
+            expireNow(*cancel->mNode);
+            cancel = next;
+        }
     }
 
-    std::optional<std::chrono::system_clock::duration> getNext() const noexcept {
+    std::optional<Clock::duration> getNext() noexcept {
         // 在这里设置epoll_wait的TIMEOUT, min(3, 下一个定时器)
         if (!hasTimer()) return std::nullopt;
-        else return mRbTimer.front().mExpireTime - std::chrono::system_clock::now();
+        auto next = mWheel ? *mWheel->nextWakeup() : mRbTimer.front().latestTime();
+        auto nowTime = now();
+        return std::max(next, nowTime) - nowTime;
     }
 
-    std::optional<std::chrono::system_clock::duration> run() {
-
-        // 这里如果如果不停,会先执行coroutine,还没来得及加进RbTree就下去了
-        // std::this_thread::sleep_for(std::chrono::milliseconds(1500));
-        while (!mRbTimer.empty()) {
-            auto nowTime = std::chrono::system_clock::now();
-            auto &promise = mRbTimer.front();
-            if (promise.mExpireTime < nowTime) {
-                mRbTimer.erase(promise);
-                std::coroutine_handle<SleepUntilPromise>::from_promise(promise).resume();
-            } else return promise.mExpireTime - nowTime;
+    std::optional<Clock::duration> run() {
+        if (!isOwnerThread()) mOwner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+        if (hasRemote()) [[unlikely]] drainRemote();
+        auto nowTime = now();
+        std::optional<Clock::duration> next;
+        if (mWheel) {
+            next = runWheel(nowTime);
+        } else {
+            // 这里如果如果不停,会先执行coroutine,还没来得及加进RbTree就下去了
+            // std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+            next = runRbTree(nowTime);
         }
-        return std::nullopt;
+        invalidateNow();
+        return next;
     }
 
     void process() {
@@ -92,52 +206,222 @@ struct TimerLoop {
     }
 
     TimerLoop& operator=(TimerLoop &&) = delete;
+
+private:
+    // 按最晚时间从前往后, 最早时间已经过了的(软到期)都触发, 包括排在还不能触发的节点后面的
+    // 软到期的节点最晚时间不会超过 now + 最大slack, 扫到那里就停, 没有带slack的定时器的时候只看最前面的
+    // 下一次醒来的时间是剩下的第一个的最晚时间, 中间最早时间到了的定时器都攒到那一次一起触发
+    std::optional<Clock::duration> runRbTree(Clock::time_point nowTime) {
+        while (!mRbTimer.empty()) {
+            // 先全部摘下来再resume, 和时间轮一样
+            TimerLink expired;
+            auto scanEnd = nowTime + mMaxSlack;
+            for (auto *node = &mRbTimer.front(); node && node->latestTime() <= scanEnd;) {
+                auto *next = mRbTimer.next(*node);
+                if (node->mExpireTime <= nowTime) {
+                    mRbTimer.erase(*node);
+                    expired.pushBack(node);
+                }
+                node = next;
+            }
+            if (!expired.linked()) break;
+            while (expired.linked()) {
+                auto *node = static_cast<TimerNode *>(expired.mNext);
+                node->unlink();
+                node->fire();
+            }
+        }
+        if (mRbTimer.empty()) {
+            mMaxSlack = {};
+            return std::nullopt;
+        }
+        return std::max(mRbTimer.front().latestTime(), nowTime) - nowTime;
+    }
+
+    std::optional<Clock::duration> runWheel(Clock::time_point nowTime) {
+        while (true) {
+            TimerLink expired;
+            mWheel->collectExpired(nowTime, expired);
+            if (!expired.linked()) break;
+            // 一个一个摘下来再resume, resume的协程可能销毁链表里别的节点(析构时自己从链表上摘掉)
+            while (expired.linked()) {
+                auto *node = static_cast<TimerNode *>(expired.mNext);
+                node->unlink();
+                node->fire();
+            }
+        }
+        auto next = mWheel->nextWakeup();
+        if (!next) return std::nullopt;
+        return std::max(*next, nowTime) - nowTime;
+    }
+
+    Clock::time_point mNow{};
+    bool mNowValid = false;
+    bool mCoarseClock = false;
+    // 红黑树里出现过的最大slack(树空了才清零), 决定软到期要往后扫多远
+    Clock::duration mMaxSlack{};
+    std::atomic<std::thread::id> mOwner{std::this_thread::get_id()};
+    MpscQueue<RemoteCancel> mRemoteCancels;
+    void *mWakeCtx = nullptr;
+    void (*mWakeFn)(void *) = nullptr;
 };
 
+// 当前线程上的AsyncLoop的定时器(AsyncLoop构造和tryRun的时候设置), 没有就是nullptr
+inline
+TimerLoop *&currentTimerLoop() noexcept {
+    static thread_local TimerLoop *current = nullptr;
+    return current;
+}
+
+// 每个线程一个, 定时器只能在注册它的线程上触发
+// 线程上有AsyncLoop的时候就是它的TimerLoop(由AsyncLoop驱动), 否则是线程局部的, 要自己run()
 inline
 TimerLoop& getTimerLoop() {
-    static TimerLoop loop;
+    if (auto *current = currentTimerLoop()) return *current;
+    static thread_local TimerLoop loop;
     return loop;
 }
 
+// 作用域内把当前线程的getTimerLoop()换成loop, 离开的时候换回去
+struct CurrentTimerLoopScope {
+    explicit CurrentTimerLoopScope(TimerLoop &loop) noexcept
+        : mPrevious(std::exchange(currentTimerLoop(), &loop)) {}
+
+    CurrentTimerLoopScope(CurrentTimerLoopScope &&) = delete;
+
+    ~CurrentTimerLoopScope() {
+        currentTimerLoop() = mPrevious;
+    }
+
+    TimerLoop *mPrevious;
+};
+
+// 协程的取消信号被触发(比如when_any里输了)就不等了: 定时器改成马上到期, 下一次run()的时候resume, co_await抛ECANCELED
+// 取消可以在任何线程上发起: 不在定时器所在的线程上就投递过去(TimerLoop::postCancel), 由那个线程去改
 struct SleepAwaiter {
+    SleepAwaiter(TimerLoop &loop, TimerLoop::Clock::time_point expireTime, TimerLoop::Clock::duration slack = {}) noexcept
+        : mLoop(loop), mExpireTime(expireTime), mSlack(slack) {}
+
+    // 挂起之前被拷贝没关系, 取消回调不拷贝
+    SleepAwaiter(SleepAwaiter const& that) noexcept
+        : mLoop(that.mLoop), mExpireTime(that.mExpireTime), mSlack(that.mSlack) {}
+
     bool await_ready() const noexcept { return false; }
 
-    void await_suspend(std::coroutine_handle<SleepUntilPromise> coroutine) {
+    bool await_suspend(std::coroutine_handle<SleepUntilPromise> coroutine) {
         auto &promise = coroutine.promise();
+        if (promise.mStopToken.stop_requested()) [[unlikely]] {
+            mCanceled = true;
+            return false;
+        }
         promise.mExpireTime = mExpireTime;
+        promise.mSlack = mSlack;
+        promise.mCoroutine = coroutine;
         mLoop.addTimer(promise);
+        if (promise.mStopToken.stop_possible())
+            mStopCallback.emplace(promise.mStopToken, Cancel{this, &promise});
+        return true;
     }
 
-    void await_resume() const noexcept { }
+    // 被resume或者销毁都在定时器所在的线程上
+    ~SleepAwaiter() {
+        detachCancel();
+    }
+
+    void await_resume() {
+        detachCancel();
+        if (mCanceled) [[unlikely]]
+            throw std::system_error(ECANCELED, std::system_category());
+    }
+
+    // 注销回调(别的线程上正在执行的话会等它结束), 投递出去的取消还没处理就当场处理掉, 之后节点就不再被引用
+    void detachCancel() {
+        mStopCallback.reset();
+        if (mRemoteCancel.mNode) [[unlikely]] {
+            mLoop.drainRemote();
+            mRemoteCancel.mNode = nullptr;
+        }
+    }
+
+    struct Cancel {
+        void operator()() const noexcept {
+            mSelf->mCanceled = true;
+            if (!mSelf->mLoop.isOwnerThread()) {
+                mSelf->mRemoteCancel.mNode = mPromise;
+                mSelf->mLoop.postCancel(mSelf->mRemoteCancel);
+                return;
+            }
+            // 已经被run()收走准备触发了(比如和赢家同一个tick到期)就留在原地, 马上就会被resume
+            mSelf->mLoop.expireNow(*mPromise);
+        }
+
+        SleepAwaiter *mSelf;
+        SleepUntilPromise *mPromise;
+    };
 
     TimerLoop &mLoop;
-    std::chrono::system_clock::time_point mExpireTime;
+    TimerLoop::Clock::time_point mExpireTime;
+    // 允许晚多久触发, 好和附近的定时器合并成一次唤醒
+    TimerLoop::Clock::duration mSlack{};
+    bool mCanceled = false;
+    TimerLoop::RemoteCancel mRemoteCancel;
+    std::optional<std::stop_callback<Cancel>> mStopCallback;
 };
 
+// 其他时钟(比如system_clock)的时间点, 按离现在还有多久换算到单调时钟上
+template <class Clock, class Dur>
+inline TimerLoop::Clock::time_point toLoopTime(TimerLoop &loop, std::chrono::time_point<Clock, Dur> time) {
+    if constexpr (std::is_same_v<Clock, TimerLoop::Clock>) {
+        return std::chrono::time_point_cast<TimerLoop::Clock::duration>(time);
+    } else {
+        return loop.now() + std::chrono::duration_cast<TimerLoop::Clock::duration>(time - Clock::now());
+    }
+}
+
 // task可以指定到特定的红黑树上
 template <class Clock, class Dur>
 inline Task<void, SleepUntilPromise>
 sleep_until(TimerLoop &loop, std::chrono::time_point<Clock, Dur> expireTime) {
-    co_await SleepAwaiter(loop, std::chrono::time_point_cast<std::chrono::system_clock::duration>(expireTime));
+    co_await SleepAwaiter(loop, toLoopTime(loop, expireTime));
 }
 
 template <class Rep, class Period>
 inline Task<void, SleepUntilPromise>
 sleep_for(TimerLoop &loop, std::chrono::duration<Rep, Period> duration) {
-    auto d = std::chrono::duration_cast<std::chrono::system_clock::duration>(duration);
+    auto d = std::chrono::duration_cast<TimerLoop::Clock::duration>(duration);
     if (d.count() > 0) 
-        co_await SleepAwaiter(loop, std::chrono::system_clock::now() + d);
+        co_await SleepAwaiter(loop, loop.now() + d);
 }
 
-Task<void, SleepUntilPromise> sleep_until(std::chrono::system_clock::time_point expireTime) {
+// 带slack: 在 [到期时间, 到期时间 + slack] 之间的某个时刻醒来, 空闲超时这种不需要准的定时器用
+// 同一个窗口里的定时器会合并成一次唤醒
+template <class Clock, class Dur, class SRep, class SPeriod>
+inline Task<void, SleepUntilPromise>
+sleep_until(TimerLoop &loop, std::chrono::time_point<Clock, Dur> expireTime, std::chrono::duration<SRep, SPeriod> slack) {
+    co_await SleepAwaiter(loop, toLoopTime(loop, expireTime), std::chrono::duration_cast<TimerLoop::Clock::duration>(slack));
+}
+
+template <class Rep, class Period, class SRep, class SPeriod>
+inline Task<void, SleepUntilPromise>
+sleep_for(TimerLoop &loop, std::chrono::duration<Rep, Period> duration, std::chrono::duration<SRep, SPeriod> slack) {
+    auto d = std::chrono::duration_cast<TimerLoop::Clock::duration>(duration);
+    if (d.count() > 0)
+        co_await SleepAwaiter(loop, loop.now() + d, std::chrono::duration_cast<TimerLoop::Clock::duration>(slack));
+}
+
+// 不带loop的版本用getTimerLoop(): 在AsyncLoop(Runtime)里就是那个loop的定时器, 在工作线程上是线程局部的
+template <class Clock, class Dur>
+inline Task<void, SleepUntilPromise>
+sleep_until(std::chrono::time_point<Clock, Dur> expireTime) {
     auto &loop = getTimerLoop();
-    co_await SleepAwaiter(loop, expireTime);
+    co_await SleepAwaiter(loop, toLoopTime(loop, expireTime));
 }
 
-Task<void, SleepUntilPromise> sleep_for(std::chrono::system_clock::duration duration) {
+template <class Rep, class Period>
+inline Task<void, SleepUntilPromise>
+sleep_for(std::chrono::duration<Rep, Period> duration) {
     auto &loop = getTimerLoop();
-    co_await SleepAwaiter(loop, std::chrono::system_clock::now() + duration);
+    co_await SleepAwaiter(loop, loop.now() + std::chrono::duration_cast<TimerLoop::Clock::duration>(duration));
 }
 
 }
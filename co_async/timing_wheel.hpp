@@ -0,0 +1,308 @@
+/**
+ * @file timing_wheel.hpp
+ * @author qc
+ * @brief 定时器节点和分层时间轮
+ * @details TimerNode 是所有定时器的基类, 同时带着红黑树节点和时间轮链表节点, 由TimerLoop决定用哪个
+ *          分层时间轮: kLevels层, 每层64个槽, 第k层一个槽跨 64^k 个tick(默认1ms一个tick)
+ *          插入: 按离现在还有多少tick决定放第几层的哪个槽, 双向链表头插, O(1)
+ *          取消: 从链表上摘下来, O(1), 节点析构(比如when_any里输掉的sleep被销毁)时自动摘
+ *          推进: 每走完第k层的一圈, 就把第k+1层当前槽里的节点重新插入(往下层降级), 到第0层的槽就到期了
+ *          每层有一个64位的占用位图, 推进和算下一次到期时间的时候直接跳过空槽, 不用一个tick一个tick地走
+ *          比红黑树省掉了O(log n)次指针跳转, 代价是精度只有一个tick
+ *          带slack的定时器对齐到窗口里尽量整的tick上, 窗口重叠的定时器就自然合并到同一次唤醒
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#pragma once
+
+#include <array>
+#include <bit>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <optional>
+#include <utilities/rbtree.hpp>
+
+namespace co_async {
+
+struct TimingWheel;
+
+// 时间轮槽里的双向循环链表, 槽本身是哨兵
+struct TimerLink {
+    TimerLink() noexcept : mPrev(this), mNext(this) {}
+
+    TimerLink(TimerLink &&) = delete;
+
+    bool linked() const noexcept { return mNext != this; }
+
+    void pushBack(TimerLink *node) noexcept {
+        node->mPrev = mPrev;
+        node->mNext = this;
+        mPrev->mNext = node;
+        mPrev = node;
+    }
+
+    void unlink() noexcept {
+        mPrev->mNext = mNext;
+        mNext->mPrev = mPrev;
+        mPrev = mNext = this;
+    }
+
+    // 把that的整条链表接到自己后面, that变成空的
+    void splice(TimerLink &that) noexcept {
+        if (!that.linked()) return;
+        that.mNext->mPrev = mPrev;
+        that.mPrev->mNext = this;
+        mPrev->mNext = that.mNext;
+        mPrev = that.mPrev;
+        that.mPrev = that.mNext = &that;
+    }
+
+    TimerLink *mPrev;
+    TimerLink *mNext;
+};
+
+// 一个定时器: 到期时间 + 到期之后resume哪个协程
+// 红黑树和时间轮同一时间最多挂在一个上面, 析构的时候从哪个上面摘都行
+// 带slack的定时器可以在 [mExpireTime, mExpireTime + mSlack] 之间任何时候触发,
+// 按最晚时间排序, 醒来的时候把最早时间已经过了的一起触发(和Linux hrtimer的soft/hard expiry一样)
+struct TimerNode : RbTree<TimerNode>::RbNode, TimerLink {
+    ~TimerNode();
+
+    std::chrono::steady_clock::time_point latestTime() const noexcept {
+        return mExpireTime + mSlack;
+    }
+
+    std::chrono::steady_clock::time_point mExpireTime;
+    std::chrono::steady_clock::duration mSlack{};
+    std::coroutine_handle<> mCoroutine{};
+    // 不为空的时候到期调用它, 而不是直接resume mCoroutine(比如IO等待的超时要先把等待从fd上摘下来)
+    void (*mOnExpire)(TimerNode &) = nullptr;
+
+    // 到期的时候由TimerLoop调用, 调用之前已经从树/轮子上摘下来了
+    void fire() {
+        if (mOnExpire) mOnExpire(*this);
+        else mCoroutine.resume();
+    }
+
+private:
+    friend struct TimingWheel;
+
+    // 在时间轮中的哪个槽(用来维护占用位图), kNoSlot表示在到期链表里
+    static constexpr std::uint16_t kNoSlot = 0xffff;
+    TimingWheel *mWheel = nullptr;
+    std::uint16_t mSlot = kNoSlot;
+
+    friend bool operator<(TimerNode const& lhs, TimerNode const& rhs) noexcept {
+        return lhs.latestTime() < rhs.latestTime();
+    }
+};
+
+struct TimingWheel {
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr std::size_t kBits = 6;
+    static constexpr std::size_t kSlots = std::size_t(1) << kBits;
+    static constexpr std::size_t kMask = kSlots - 1;
+    // 6层 * 64槽, 1ms一个tick的时候能表示 64^6ms ≈ 2年, 更远的先放最高层,到时候再重新插入
+    static constexpr std::size_t kLevels = 6;
+
+    explicit TimingWheel(Clock::time_point origin, Clock::duration tick = std::chrono::milliseconds(1))
+        : mTick(tick), mOrigin(origin) {}
+
+    TimingWheel(TimingWheel &&) = delete;
+
+    ~TimingWheel() {
+        // 还挂着的节点以后析构的时候不要再来找这个轮子
+        auto detach = [](TimerLink &head) {
+            while (head.linked()) {
+                auto *node = static_cast<TimerNode *>(head.mNext);
+                node->unlink();
+                node->mWheel = nullptr;
+            }
+        };
+        for (auto &level : mSlots)
+            for (auto &slot : level) detach(slot);
+        detach(mExpired);
+    }
+
+    bool empty() const noexcept {
+        return mSize == 0;
+    }
+
+    void insert(TimerNode &node) noexcept {
+        node.mWheel = this;
+        ++mSize;
+        place(node);
+    }
+
+    void erase(TimerNode &node) noexcept {
+        if (node.mWheel != this) return;
+        detachNode(node);
+    }
+
+    // 还在轮子上(已经被collectExpired收走的不算)
+    bool contains(TimerNode const &node) const noexcept {
+        return node.mWheel == this;
+    }
+
+    // 把到期时间在now之前的节点全部移到out里(同一个tick内不保证顺序),由调用者去resume
+    void collectExpired(Clock::time_point now, TimerLink &out) noexcept {
+        advance(toTick(now));
+        TimerLink list;
+        list.splice(mExpired);
+        while (list.linked()) {
+            auto *node = static_cast<TimerNode *>(list.mNext);
+            node->unlink();
+            // 超出范围被截断到最高层的, 还没真正到期, 重新插入
+            if (node->mExpireTime > now) {
+                place(*node);
+                continue;
+            }
+            node->mWheel = nullptr;
+            --mSize;
+            out.pushBack(node);
+        }
+    }
+
+    // 下一次需要醒来的时间, 可能是某个节点到期, 也可能是要把高层的槽降级
+    std::optional<Clock::time_point> nextWakeup() const noexcept {
+        if (mSize == 0) return std::nullopt;
+        if (mExpired.linked()) return Clock::time_point::min();
+        std::uint64_t best = ~std::uint64_t(0);
+        for (std::size_t level = 0; level < kLevels; ++level) {
+            if (!mBitmap[level]) continue;
+            std::size_t shift = level * kBits;
+            std::size_t index = (mCurrent >> shift) & kMask;
+            // 从当前槽的下一个开始找, 找不到就绕回来
+            std::uint64_t rotated = std::rotr(mBitmap[level], (int)((index + 1) & kMask));
+            std::uint64_t distance = (std::uint64_t)std::countr_zero(rotated) + 1;
+            best = std::min(best, ((mCurrent >> shift) + distance) << shift);
+        }
+        return mOrigin + mTick * (std::int64_t)best;
+    }
+
+private:
+    friend struct TimerNode;
+
+    std::uint64_t toTick(Clock::time_point t) const noexcept {
+        if (t <= mOrigin) return 0;
+        return (std::uint64_t)((t - mOrigin) / mTick);
+    }
+
+    // 向上取整, 保证不会提前到期
+    std::uint64_t toExpireTick(Clock::time_point t) const noexcept {
+        if (t <= mOrigin) return 0;
+        auto d = t - mOrigin;
+        return (std::uint64_t)((d + mTick - Clock::duration(1)) / mTick);
+    }
+
+    // 带slack的定时器放在 [最早tick, 最晚tick] 里末尾0最多的那个tick上(对齐到尽量大的2的幂)
+    // 窗口有重叠的定时器大概率落到同一个tick, 一次唤醒全部触发, 不用比较别的定时器, O(1)
+    std::uint64_t slotTick(TimerNode const& node) const noexcept {
+        std::uint64_t lo = toExpireTick(node.mExpireTime);
+        if (node.mSlack.count() <= 0 || lo == 0) return lo;
+        std::uint64_t hi = toTick(node.latestTime());
+        if (hi <= lo) return lo;
+        // lo-1和hi最高的不同位以下全部清零, 就是区间里末尾0最多的数
+        int bit = std::bit_width((lo - 1) ^ hi) - 1;
+        return hi & ~((std::uint64_t(1) << bit) - 1);
+    }
+
+    void place(TimerNode &node) noexcept {
+        std::uint64_t expire = slotTick(node);
+        if (expire <= mCurrent) {
+            node.mSlot = TimerNode::kNoSlot;
+            mExpired.pushBack(&node);
+            return;
+        }
+        ++mSlotted;
+        std::uint64_t delta = expire - mCurrent;
+        std::size_t level = 0;
+        while (level + 1 < kLevels && delta >= (std::uint64_t(1) << ((level + 1) * kBits)))
+            ++level;
+        if (level + 1 == kLevels && delta >= (std::uint64_t(1) << (kLevels * kBits)))
+            expire = mCurrent + (std::uint64_t(1) << (kLevels * kBits)) - 1;
+        std::size_t index = (expire >> (level * kBits)) & kMask;
+        node.mSlot = (std::uint16_t)(level * kSlots + index);
+        mSlots[level][index].pushBack(&node);
+        mBitmap[level] |= std::uint64_t(1) << index;
+    }
+
+    void detachNode(TimerNode &node) noexcept {
+        node.unlink();
+        if (node.mSlot != TimerNode::kNoSlot) {
+            std::size_t level = node.mSlot / kSlots, index = node.mSlot % kSlots;
+            if (!mSlots[level][index].linked())
+                mBitmap[level] &= ~(std::uint64_t(1) << index);
+            --mSlotted;
+        }
+        node.mWheel = nullptr;
+        node.mSlot = TimerNode::kNoSlot;
+        --mSize;
+    }
+
+    // 把某一层某个槽里的节点全部拿出来重新插入(第0层就是全部到期)
+    void cascade(std::size_t level, std::size_t index) noexcept {
+        TimerLink list;
+        list.splice(mSlots[level][index]);
+        mBitmap[level] &= ~(std::uint64_t(1) << index);
+        while (list.linked()) {
+            auto *node = static_cast<TimerNode *>(list.mNext);
+            node->unlink();
+            --mSlotted;
+            place(*node);
+        }
+    }
+
+    // 推进到target这个tick, 途中到期的节点都放进mExpired
+    void advance(std::uint64_t target) noexcept {
+        while (mCurrent < target) {
+            if (mSlotted == 0) {
+                mCurrent = target;
+                return;
+            }
+            // 第0层这一圈里下一个有节点的tick, 没有就直接跳到这一圈结束
+            std::size_t index = mCurrent & kMask;
+            std::uint64_t next = (mCurrent | kMask) + 1;
+            std::uint64_t rest = index == kMask ? 0 : mBitmap[0] & (~std::uint64_t(0) << (index + 1));
+            if (rest) next = (mCurrent & ~std::uint64_t(kMask)) + (std::uint64_t)std::countr_zero(rest);
+            if (next > target) {
+                mCurrent = target;
+                return;
+            }
+            mCurrent = next;
+            if ((mCurrent & kMask) == 0) {
+                // 走完了一圈, 把上面各层当前槽降级下来
+                for (std::size_t level = 1; level < kLevels; ++level) {
+                    std::size_t i = (mCurrent >> (level * kBits)) & kMask;
+                    cascade(level, i);
+                    if (i != 0) break;
+                }
+            }
+            cascade(0, mCurrent & kMask);
+        }
+    }
+
+    Clock::duration mTick;
+    Clock::time_point mOrigin;
+    std::uint64_t mCurrent = 0;
+    std::size_t mSize = 0;
+    // 挂在槽里的节点数(mSize减去mExpired里的)
+    std::size_t mSlotted = 0;
+    std::array<std::uint64_t, kLevels> mBitmap{};
+    std::array<std::array<TimerLink, kSlots>, kLevels> mSlots;
+    // 已经到期(或者插入的时候就已经过期)还没被取走的
+    TimerLink mExpired;
+};
+
+inline TimerNode::~TimerNode() {
+    // 在轮子里就让轮子维护计数和位图; 已经被取出来等着resume的, 从临时链表上摘掉
+    if (mWheel) mWheel->erase(*this);
+    else if (linked()) unlink();
+}
+
+}
@@ -0,0 +1,144 @@
+/**
+ * @file transfer.hpp
+ * @author qc
+ * @brief 两个AsyncFile之间的零拷贝传输
+ * @details 用流发文件要先read到IStreamBase的缓冲区, 再从OStreamBase的缓冲区write出去, 每个字节在用户态拷两次
+ *          transfer让内核直接搬:
+ *          1. 源是普通文件(或块设备): sendfile, 数据从页缓存直接进socket
+ *          2. 源是socket/管道(代理): splice到一个管道, 再从管道splice到目标, 搬的只是页的引用
+ *          目标写满了(EAGAIN)就挂起等EPOLLOUT, 源读空了就等EPOLLIN, 和read_file/write_file一样先乐观地试
+ *          用流包装过的fd要先flush, 否则缓冲区里的数据会排在transfer的数据后面
+ *          只有epoll版本, io_uring没有sendfile操作
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <limits>
+#include <optional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include "task.hpp"
+#include "ioLoop.hpp"
+
+namespace co_async {
+
+// 没有指定长度就一直搬到源的EOF
+inline constexpr std::size_t kTransferToEof = std::numeric_limits<std::size_t>::max();
+
+// splice中转用的管道, 两端都是非阻塞的, 析构的时候关掉
+struct TransferPipe {
+    TransferPipe() {
+        checkError(pipe2(mFds, O_NONBLOCK | O_CLOEXEC));
+    }
+
+    TransferPipe(TransferPipe &&) = delete;
+
+    ~TransferPipe() {
+        close(mFds[0]);
+        close(mFds[1]);
+    }
+
+    int readEnd() const noexcept { return mFds[0]; }
+    int writeEnd() const noexcept { return mFds[1]; }
+
+private:
+    int mFds[2];
+};
+
+// 源 -> 管道 -> 目标, 管道空了才从源再灌一次, 所以源那边EAGAIN一定是源读空了(管道不会满)
+// 管道里还有数据的时候目标EAGAIN就是目标写满了
+inline
+Task<std::size_t> spliceTransfer(IoLoop &loop, AsyncFile &src, AsyncFile &dst, off_t offset, std::size_t len,
+                                 std::optional<TimerLoop::Clock::time_point> deadline) {
+    TransferPipe pipe;
+    loff_t off = offset;
+    loff_t *offp = offset >= 0 ? &off : nullptr;
+    std::size_t total = 0;
+    std::size_t inPipe = 0;
+    while (total < len) {
+        if (inPipe == 0) {
+            // 一次最多一个管道容量(默认64K), 长度给大了也没关系
+            ssize_t n = splice(src.fileNo(), offp, pipe.writeEnd(), nullptr, std::min<std::size_t>(len - total, 1 << 20),
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == 0) break;
+            if (n == -1) {
+                if (errno != EAGAIN) [[unlikely]] checkError(n);
+                loop.markDrained(src, EPOLLIN);
+                co_await wait_file_event(loop, src, EPOLLIN | EPOLLRDHUP, deadline);
+                continue;
+            }
+            inPipe = (std::size_t)n;
+        }
+        while (inPipe != 0) {
+            ssize_t n = splice(pipe.readEnd(), nullptr, dst.fileNo(), nullptr, inPipe,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (total + inPipe < len ? SPLICE_F_MORE : 0));
+            if (n == -1) {
+                if (errno != EAGAIN) [[unlikely]] checkError(n);
+                loop.markDrained(dst, EPOLLOUT);
+                co_await wait_file_event(loop, dst, EPOLLOUT, deadline);
+                continue;
+            }
+            inPipe -= (std::size_t)n;
+            total += (std::size_t)n;
+        }
+    }
+    co_return total;
+}
+
+// sendfile一次最多搬0x7ffff000字节
+inline
+Task<std::size_t> sendfileTransfer(IoLoop &loop, AsyncFile &src, AsyncFile &dst, off_t offset, std::size_t len,
+                                   std::optional<TimerLoop::Clock::time_point> deadline) {
+    off_t off = offset;
+    off_t *offp = offset >= 0 ? &off : nullptr;
+    std::size_t total = 0;
+    bool tryNow = !loop.isDrained(dst, EPOLLOUT);
+    while (total < len) {
+        if (tryNow) {
+            std::size_t chunk = std::min<std::size_t>(len - total, 0x7ffff000);
+            ssize_t n = sendfile(dst.fileNo(), src.fileNo(), offp, chunk);
+            if (n == 0) break;
+            if (n > 0) {
+                // 没搬完可能是socket缓冲区满了, 也可能是到了文件末尾, 分不清就不能标记drained:
+                // 到末尾时socket其实还可写, 标记了之后的写就要等一个不会来的EPOLLOUT边沿(TCP只在写满过之后才通知)
+                // 接着再调一次, 写满了会返回EAGAIN, 到末尾会返回0
+                total += (std::size_t)n;
+                continue;
+            }
+            if (errno == EINVAL || errno == ENOSYS) {
+                // 这种组合内核不支持sendfile, 换成splice接着搬
+                co_return total + co_await spliceTransfer(loop, src, dst, offset >= 0 ? off : -1, len - total, deadline);
+            }
+            if (errno != EAGAIN) [[unlikely]] checkError(n);
+            loop.markDrained(dst, EPOLLOUT);
+        }
+        co_await wait_file_event(loop, dst, EPOLLOUT, deadline);
+        tryNow = true;
+    }
+    co_return total;
+}
+
+// 从src搬最多len字节到dst, 返回实际搬了多少(源先到EOF就比len少)
+// offset 传 -1 表示和read一样使用并推进src的当前偏移; 否则从offset开始读, 不改变src的偏移(socket/管道只能传-1)
+// deadline是绝对时间, 到了还没搬完就抛ETIMEDOUT, 已经搬过去的数据不会退回
+inline
+Task<std::size_t> transfer(IoLoop &loop, AsyncFile &src, AsyncFile &dst, off_t offset = -1,
+                           std::size_t len = kTransferToEof,
+                           std::optional<TimerLoop::Clock::time_point> deadline = std::nullopt) {
+    struct stat st;
+    checkError(fstat(src.fileNo(), &st));
+    if (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))
+        return sendfileTransfer(loop, src, dst, offset, len, deadline);
+    return spliceTransfer(loop, src, dst, offset, len, deadline);
+}
+
+}
@@ -0,0 +1,293 @@
+/**
+ * @file uringLoop.hpp
+ * @author qc
+ * @brief 基于io_uring的完成式事件循环,和ioLoop.hpp中的epoll反应式循环二选一
+ * @details epoll: 先等fd就绪(epoll_ctl + epoll_wait),再自己去read/write,一次IO至少三次系统调用
+ *          io_uring: 直接把read/write/accept/connect/openat作为SQE提交给内核,内核做完之后放进CQE,
+ *          我们只要从CQE里拿到结果resume对应的协程即可,多个SQE在tryRun中一次io_uring_enter批量提交
+ *          需要liburing, 编译时定义 CO_ASYNC_USE_IO_URING 才会启用(见顶层CMakeLists.txt)
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#pragma once
+
+#if CO_ASYNC_USE_IO_URING
+
+#include <liburing.h>
+#include <fcntl.h>
+#include <coroutine>
+#include <chrono>
+#include <optional>
+#include <stop_token>
+#include <vector>
+#include <span>
+#include <tuple>
+#include <filesystem>
+#include <system_error>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <co_async/task.hpp>
+#include <co_async/ioLoop.hpp>
+#include <co_async/socket.hpp>
+#include <co_async/filesystem.hpp>
+
+namespace co_async {
+
+// io_uring的返回值不设置errno, 而是直接返回 -errno
+inline
+auto checkErrorUring(auto res, std::source_location const& loc = std::source_location::current()) {
+    if (res < 0) [[unlikely]]
+        throw std::system_error(-res, std::system_category(),
+                                (std::string)loc.file_name() + ":" + std::to_string(loc.line()));
+    return res;
+}
+
+struct IoUringLoop {
+    explicit IoUringLoop(unsigned entries = 512) {
+        checkErrorUring(io_uring_queue_init(entries, &mRing, 0));
+    }
+
+    // 拿一个空的SQE, SQ满了就先把已有的提交掉
+    io_uring_sqe *getSqe() {
+        io_uring_sqe *sqe = io_uring_get_sqe(&mRing);
+        if (!sqe) [[unlikely]] {
+            checkErrorUring(io_uring_submit(&mRing));
+            sqe = io_uring_get_sqe(&mRing);
+            if (!sqe) [[unlikely]]
+                throw std::system_error(EBUSY, std::system_category(), "io_uring_get_sqe");
+        }
+        ++mCount;
+        return sqe;
+    }
+
+    bool hasEvent() const noexcept { return mCount != 0; }
+
+    // ring fd在CQ里有完成事件的时候可读, AsyncLoop把它挂到epoll上, 和fd事件一起在epoll_wait里等
+    int ringFd() const noexcept { return mRing.ring_fd; }
+
+    // 只提交攒下来的SQE, 不等待
+    void submit() {
+        checkErrorUring(io_uring_submit(&mRing));
+    }
+
+    // 取出已经完成的CQE, resume对应的协程, 不等待
+    void reap();
+
+    bool tryRun(std::optional<std::chrono::steady_clock::duration> timeout = std::nullopt);
+
+    void process() {
+        while (hasEvent()) tryRun();
+    }
+
+    IoUringLoop& operator=(IoUringLoop&&) = delete;
+
+    ~IoUringLoop() {
+        io_uring_queue_exit(&mRing);
+    }
+
+    io_uring mRing;
+
+    // 已经提交但还没收到CQE的操作数
+    std::size_t mCount = 0;
+
+    io_uring_cqe *mCqeBuf[64];
+};
+
+// 一个SQE对应一个Awaiter, user_data 指向Awaiter, CQE回来的时候填好mRes再resume
+// Awaiter是按值返回的普通对象,挂起期间就存在调用者的协程帧里,不用单独分配协程帧
+// 协程的取消信号被触发(比如when_any里输了)就再提交一个IORING_OP_ASYNC_CANCEL, 操作以-ECANCELED结束
+// 和IoLoop一样, 取消要在驱动这个loop的线程上发起(ring不是线程安全的)
+struct UringOpAwaiter {
+    explicit UringOpAwaiter(IoUringLoop &loop) : mSqe(loop.getSqe()), mLoop(&loop) {
+        io_uring_sqe_set_data(mSqe, this);
+    }
+
+    // 带deadline: 操作SQE后面紧跟一个IORING_OP_LINK_TIMEOUT, 到时间内核自己取消操作(结果是-ECANCELED)
+    // 两个SQE必须在同一次提交里, 所以SQ剩下不到两个的时候先提交掉
+    UringOpAwaiter(IoUringLoop &loop, std::optional<std::chrono::steady_clock::time_point> deadline)
+        : mLoop(&loop), mDeadline(deadline) {
+        if (mDeadline && io_uring_sq_space_left(&loop.mRing) < 2)
+            checkErrorUring(io_uring_submit(&loop.mRing));
+        mSqe = loop.getSqe();
+        io_uring_sqe_set_data(mSqe, this);
+    }
+
+    UringOpAwaiter(UringOpAwaiter &&) = delete;
+
+    // io_uring_prep_xxx会把flags清零, 所以要在prep之后调用
+    void linkTimeout() {
+        if (!mDeadline) return;
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(mDeadline->time_since_epoch()).count();
+        mTimeout.tv_sec = ns / 1000000000;
+        mTimeout.tv_nsec = ns % 1000000000;
+        mSqe->flags |= IOSQE_IO_LINK;
+        io_uring_sqe *sqe = mLoop->getSqe();
+        // steady_clock就是CLOCK_MONOTONIC, 直接用绝对时间; user_data为空, tryRun收到它的CQE直接跳过
+        io_uring_prep_link_timeout(sqe, &mTimeout, IORING_TIMEOUT_ABS);
+        io_uring_sqe_set_data(sqe, nullptr);
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    template <class P>
+    void await_suspend(std::coroutine_handle<P> coroutine) {
+        mPrevious = coroutine;
+        if constexpr (requires { coroutine.promise().mStopToken; }) {
+            // 已经取消了的话回调马上执行, 取消的SQE排在操作的SQE后面, 一起提交
+            if (coroutine.promise().mStopToken.stop_possible())
+                mStopCallback.emplace(coroutine.promise().mStopToken, Cancel{this});
+        }
+    }
+
+    // 被超时取消的操作返回-ETIMEDOUT, 和epoll版本一样; 被取消信号取消的返回-ECANCELED
+    int await_resume() noexcept {
+        mStopCallback.reset();
+        if (mDeadline && !mCanceled && mRes == -ECANCELED) return -ETIMEDOUT;
+        return mRes;
+    }
+
+    struct Cancel {
+        void operator()() const noexcept {
+            mSelf->mCanceled = true;
+            // SQ满了提交失败就只能等操作自己结束
+            try {
+                io_uring_sqe *sqe = mSelf->mLoop->getSqe();
+                io_uring_prep_cancel(sqe, mSelf, 0);
+                io_uring_sqe_set_data(sqe, nullptr);
+            } catch (...) {
+            }
+        }
+
+        UringOpAwaiter *mSelf;
+    };
+
+    io_uring_sqe *mSqe{};
+    IoUringLoop *mLoop = nullptr;
+    std::optional<std::chrono::steady_clock::time_point> mDeadline;
+    // 内核在提交的时候才读, 要活到提交之后
+    __kernel_timespec mTimeout{};
+    std::coroutine_handle<> mPrevious{};
+    int mRes = 0;
+    bool mCanceled = false;
+    std::optional<std::stop_callback<Cancel>> mStopCallback;
+};
+
+inline bool
+IoUringLoop::tryRun(std::optional<std::chrono::steady_clock::duration> timeout) {
+    __kernel_timespec ts, *pts = nullptr;
+    if (timeout) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(*timeout).count();
+        if (ns < 0) ns = 0;
+        ts.tv_sec = ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        pts = &ts;
+    }
+    // 提交所有攒下来的SQE并等待至少一个CQE, 一次系统调用
+    io_uring_cqe *cqe;
+    int rt = io_uring_submit_and_wait_timeout(&mRing, &cqe, 1, pts, nullptr);
+    if (rt < 0 && rt != -ETIME && rt != -EINTR) [[unlikely]]
+        checkErrorUring(rt);
+    reap();
+    return true;
+}
+
+inline void
+IoUringLoop::reap() {
+    unsigned n = io_uring_peek_batch_cqe(&mRing, mCqeBuf, std::size(mCqeBuf));
+    // 先把结果全部取出来并归还CQ, 再resume, resume中可能会继续getSqe
+    UringOpAwaiter *ready[std::size(mCqeBuf)];
+    unsigned nready = 0;
+    for (unsigned i = 0; i < n; ++i) {
+        auto *awaiter = (UringOpAwaiter *)io_uring_cqe_get_data(mCqeBuf[i]);
+        // 链接的超时SQE和取消SQE自己的CQE, 没有协程在等
+        if (!awaiter) continue;
+        awaiter->mRes = mCqeBuf[i]->res;
+        ready[nready++] = awaiter;
+    }
+    io_uring_cq_advance(&mRing, n);
+    mCount -= n;
+    for (unsigned i = 0; i < nready; ++i)
+        ready[i]->mPrevious.resume();
+}
+
+// 下面是 ioLoop.hpp / socket.hpp / filesystem.hpp 中同名函数的io_uring版本, 按loop类型重载
+// offset 传 -1 表示和read/write一样使用并推进文件当前偏移
+
+// io_uring没有按fd的登记项, 直接关
+inline
+void close_file(IoUringLoop &, AsyncFile &file) {
+    if (file.fileNo() < 0) return;
+    close(file.releaseOwnership());
+}
+
+inline
+Task<std::size_t> read_file(IoUringLoop &loop, AsyncFile &file, std::span<char> buffer,
+                            std::optional<std::chrono::steady_clock::time_point> deadline = std::nullopt) {
+    UringOpAwaiter op(loop, deadline);
+    io_uring_prep_read(op.mSqe, file.fileNo(), buffer.data(), buffer.size(), (__u64)-1);
+    op.linkTimeout();
+    co_return (std::size_t)checkErrorUring(co_await op);
+}
+
+inline
+Task<std::size_t> write_file(IoUringLoop &loop, AsyncFile &file, std::span<char const> buffer,
+                             std::optional<std::chrono::steady_clock::time_point> deadline = std::nullopt) {
+    UringOpAwaiter op(loop, deadline);
+    io_uring_prep_write(op.mSqe, file.fileNo(), buffer.data(), buffer.size(), (__u64)-1);
+    op.linkTimeout();
+    co_return (std::size_t)checkErrorUring(co_await op);
+}
+
+inline
+Task<std::size_t> writev_file(IoUringLoop &loop, AsyncFile &file, std::span<struct iovec const> iov,
+                              std::optional<std::chrono::steady_clock::time_point> deadline = std::nullopt) {
+    UringOpAwaiter op(loop, deadline);
+    io_uring_prep_writev(op.mSqe, file.fileNo(), iov.data(), (unsigned)std::min<std::size_t>(iov.size(), IOV_MAX), (__u64)-1);
+    op.linkTimeout();
+    co_return (std::size_t)checkErrorUring(co_await op);
+}
+
+inline
+Task<void> socketConnect(IoUringLoop &loop, AsyncFile &sock, SocketAddress const& addr,
+                         std::optional<std::chrono::steady_clock::time_point> deadline = std::nullopt) {
+    UringOpAwaiter op(loop, deadline);
+    io_uring_prep_connect(op.mSqe, sock.fileNo(), (sockaddr const *)&addr.mAddr, addr.mAddrLen);
+    op.linkTimeout();
+    checkErrorUring(co_await op);
+}
+
+inline
+Task<AsyncFile> create_tcp_client(IoUringLoop &loop, SocketAddress const& addr,
+                                  std::optional<std::chrono::steady_clock::time_point> deadline = std::nullopt) {
+    AsyncFile sock(checkError(socket(addr.mAddr.ss_family, SOCK_STREAM, 0)));
+    co_await socketConnect(loop, sock, addr, deadline);
+    co_return sock;
+}
+
+template <class AddrType>
+inline Task<std::tuple<AsyncFile, AddrType>> socket_accept(IoUringLoop &loop, AsyncFile &sock,
+                                                           std::optional<std::chrono::steady_clock::time_point> deadline = std::nullopt) {
+    AddrType addr;
+    addr.mAddrLen = sizeof(addr.mAddr);
+    UringOpAwaiter op(loop, deadline);
+    io_uring_prep_accept(op.mSqe, sock.fileNo(), (sockaddr *)&addr.mAddr, &addr.mAddrLen, 0);
+    op.linkTimeout();
+    int rt = checkErrorUring(co_await op);
+    co_return {AsyncFile(rt), addr};
+}
+
+// 普通文件在epoll中永远是就绪的(EPERM), 只有io_uring能真正异步打开和读写
+inline
+Task<AsyncFile> open_fs_file(IoUringLoop &loop, std::filesystem::path path, OpenMode mode, mode_t access = 0644) {
+    UringOpAwaiter op(loop);
+    io_uring_prep_openat(op.mSqe, AT_FDCWD, path.c_str(), (int)mode, access);
+    int res = checkErrorUring(co_await op);
+    co_return AsyncFile(res);
+}
+
+}
+
+#endif
@@ -11,101 +11,96 @@
  */
 #pragma once
 
+#include <atomic>
 #include <coroutine>
-#include <span>
+#include <stop_token>
 #include <tuple>
+#include <cerrno>
+#include <ranges>
+#include <system_error>
+#include <utility>
 #include <variant> // 多选一 不能是void
 #include <type_traits>
 #include <utilities/uninitialized.hpp>
 #include "task.hpp"
 #include "concepts.hpp"
-#include "return_previous.hpp"
+#include "when_child.hpp"
 
 using namespace std::chrono_literals;
 
 namespace co_async {
 
-struct WhenAnyCtlBlock {
-    static constexpr std::size_t kNullIndex = std::size_t(-1);
-
-    std::size_t mIndex{kNullIndex};
-    std::coroutine_handle<> mPrevious{};
-    std::exception_ptr mException{};
-};
-
-struct WhenAnyAwaiter {
-    bool await_ready() const noexcept { return false; }
-
-    std::coroutine_handle<>
-    await_suspend(std::coroutine_handle<> coroutine) const {
-        if (mTasks.empty()) return coroutine;
-        mControl.mPrevious = coroutine;
-        // 这里是线性执行的哦,只有遇到sleep才会加入队列
-        for (auto const &t : mTasks.subspan(0, mTasks.size() - 1)) 
-            t.mCoroutine.resume();
-        return mTasks.back().mCoroutine;
+// 第一个结束的子任务(正常返回或者抛异常都算)抢到名次, 然后通过mStop取消其余的子任务
+// 输掉的子任务收到取消之后从定时器/epoll上摘下来, 抛ECANCELED一路退出来, 帧里的东西都析构掉
+// 所有子任务都结束了才回到调用者, 不会有子任务还挂着而它的槽位已经被销毁
+// 子任务可能在不同线程上结束(比如挂在工作窃取调度器上), 计数和名次都用原子变量
+struct WhenAnyCtlBlock : WhenCtlBlock {
+    // 抢到第一名返回true, 同时取消其余的子任务
+    bool win(std::size_t index) {
+        std::size_t expected = kNullIndex;
+        if (!mIndex.compare_exchange_strong(expected, index, std::memory_order_acq_rel))
+            return false;
+        mStop.request_stop();
+        return true;
     }
 
-    void await_resume() const {
-        if (mControl.mException) [[unlikely]] 
-            std::rethrow_exception(mControl.mException);
+    void record(std::size_t index, bool) noexcept {
+        win(index);
     }
 
-    WhenAnyCtlBlock &mControl;
-    // 其参数是一个引用,在使用arry转换为span的时候不需要知道数组的长度,这里可以自动推算出来
-    std::span<ReturnPreviousTask const> mTasks;
-};
-
-// T 决定了 ts 就决定了
-// Q : 这里模板参数用 Awaiter 还是 T ?
-// A : 为了区分void和普通类型,由于通过T可以推导出Awaiter所以使用T更好
-// 如果用Awaiter,那么如何特化void版本呢?
-// template <Awaiter Ts>
-// ReturnPreviousTask whenAnyHelper(Ts &&ts, WhenAnyCtlBlock &control, Uninitialized<typename AwaitableTraits<Ts>::RetType> &result, std::size_t index) 
-template <class T>
-ReturnPreviousTask whenAnyHelper(auto &&t, WhenAnyCtlBlock &control, Uninitialized<T> &result, std::size_t index) {
-    try {
-        result.putValue((co_await std::forward<decltype(t)>(t), NonVoidHelper<>()));
-    } catch (...) {
-        control.mException = std::current_exception();
-        co_return control.mPrevious;
+    std::coroutine_handle<> finish(std::size_t index, bool failed) noexcept {
+        record(index, failed);
+        return release();
     }
-    --control.mIndex = index;
-    co_return control.mPrevious;
-}
 
-// template <class = void>
-// ReturnPreviousTask whenAnyHelper(auto &&t, WhenAnyCtlBlock &control, Uninitialized<void> &, std::size_t index) {
-//     try {
-//         result.putValue((co_await std::forward<decltype(t)>(t), NonVoidHelper<>()));
-//     } catch (...) {
-//         control.mException = std::current_exception();
-//         co_return control.mPrevious;
-//     }
-//     --control.mIndex = index;
-//     co_return control.mPrevious;
-// }
+    std::stop_token token() const noexcept {
+        return mStop.get_token();
+    }
 
+    std::atomic<std::size_t> mIndex{kNullIndex};
+    std::stop_source mStop{};
+};
 
 template <std::size_t... Is, class... Ts>
 Task<std::variant<typename AwaitableTraits<Ts>::NonVoidRetType...>>
 whenAnyImpl(std::index_sequence<Is...>, Ts &&... ts) {
     // CtlBlock
     WhenAnyCtlBlock control{};
-    std::tuple<Uninitialized<typename AwaitableTraits<Ts>::RetType>...> result;
-    ReturnPreviousTask taskArray[] {
-        whenAnyHelper(ts, control, std::get<Is>(result), Is)...
-    };
-    // 只要有一个执行完就会回到这里,在于ReturnPreviousTask中直接co_return previous;
-    co_await WhenAnyAwaiter(control, taskArray);
+    // 外面取消了when_any, 就把所有子任务都取消掉
+    std::stop_callback cancelAll(co_await get_stop_token(), [&control] { control.mStop.request_stop(); });
+    std::tuple<WhenChild<WhenAnyCtlBlock, Ts>...> children(ts...);
+    // 第一个执行完并且其余的都取消完了才会回到这里
+    co_await WhenChildrenAwaiter(control, children);
 
-    Uninitialized<std::variant<typename AwaitableTraits<Ts>::NonVoidRetType...>> varResult;
+    std::size_t index = control.mIndex.load(std::memory_order_acquire);
+    // 输掉的: 被取消抛出来的ECANCELED直接丢掉, 晚到的结果(取消之前刚好做完了)没人要, 析构掉
+    ((Is != index && (std::get<Is>(children).discard(), false)), ...);
 
-    ((control.mIndex == Is && (varResult.putValue(std::in_place_index<Is>, std::get<Is>(result).moveValue()), 0)),...);
+    Uninitialized<std::variant<typename AwaitableTraits<Ts>::NonVoidRetType...>> varResult;
+    // 赢的那个抛了异常就在这里抛出去
+    ((Is == index && (varResult.putValue(std::in_place_index<Is>, std::get<Is>(children).result()), false)), ...);
     co_return varResult.moveValue();
 }
 
 
+template <class R>
+Task<std::pair<std::size_t, typename AwaitableTraits<std::ranges::range_reference_t<R>>::NonVoidRetType>>
+whenAnyRangeImpl(R &range) {
+    using Control = WhenRangeCtlBlock<WhenAnyCtlBlock, std::ranges::range_reference_t<R>>;
+    Control control{};
+    std::stop_callback cancelAll(co_await get_stop_token(), [&control] { control.mStop.request_stop(); });
+    auto children = whenRangeChildren(control, range);
+    // 一个子任务都没有的话永远不会有第一名
+    if (control.mSize == 0) [[unlikely]]
+        throw std::system_error(EINVAL, std::system_category(), "when_any: empty range");
+    control.mLimit = control.mSize;
+    co_await WhenRangeAwaiter(control);
+    std::size_t index = control.mIndex.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < control.mSize; ++i)
+        if (i != index) children[i]->discard();
+    co_return {index, children[index]->result()};
+}
+
 // when_any 协程实现 本质上是Task + tuple
 template <Awaitable... Ts>
     requires(sizeof...(Ts) != 0)
@@ -113,4 +108,10 @@ auto when_any(Ts &&... ts) {
     return whenAnyImpl(std::make_index_sequence<sizeof...(ts)>{}, std::forward<Ts>(ts)...);
 }
 
-}
\ No newline at end of file
+// 运行时个数的版本, 返回 {第几个, 它的结果}
+template <AwaitableRange R>
+auto when_any(R &&range) {
+    return whenAnyRangeImpl(range);
+}
+
+}
@@ -0,0 +1,263 @@
+/**
+ * @file when_child.hpp
+ * @author qc
+ * @brief when_all/when_any共用的子任务槽位
+ * @details 原来每个子任务都要包一层whenAllHelper/whenAnyHelper协程(ReturnPreviousTask), N个子任务就是N个额外的协程帧
+ *          现在子任务的槽位(WhenChild)直接放在whenAllImpl/whenAnyImpl的帧里(一个tuple):
+ *          1. 子任务是Task: 槽位本身就是一个Continuation, 挂到子任务Promise的mContinuation上, 子任务final_suspend的时候
+ *             直接调用它更新计数, 结果和异常就留在子任务自己的Promise里, 最后再取, 不需要任何额外的协程帧
+ *          2. 其他可等待对象(裸的Awaiter等): 没有Promise可以挂, 还是包一层ReturnPreviousTask协程
+ *          控制块的计数是原子的, 子任务可以在别的线程上结束; 所有子任务都结束之后才回到调用者
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#pragma once
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <ranges>
+#include <stop_token>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <utilities/uninitialized.hpp>
+#include <utilities/non_void_helper.hpp>
+#include "task.hpp"
+#include "concepts.hpp"
+#include "previous_awaiter.hpp"
+#include "return_previous.hpp"
+
+namespace co_async {
+
+// 控制块共同的部分: 还有几个子任务没结束, 最后一个结束的回到调用者
+// 派生的控制块提供 record(index, failed) 记下子任务的结局, finish 就是 record + release
+struct WhenCtlBlock {
+    static constexpr std::size_t kNullIndex = std::size_t(-1);
+
+    std::coroutine_handle<> release() noexcept {
+        if (mPending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            return mPrevious;
+        return std::noop_coroutine();
+    }
+
+    std::atomic<std::size_t> mPending{0};
+    std::coroutine_handle<> mPrevious{};
+};
+
+// Promise里有mContinuation的Task(Promise<T>和从它派生的), 可以直接挂到槽位上
+template <class A>
+concept ContinuableTask = requires(std::remove_cvref_t<A> &t) {
+    t.mCoroutine.promise().mContinuation;
+    t.mCoroutine.promise().mException;
+    t.mCoroutine.promise().mStopToken;
+};
+
+// 其他可等待对象: 包一层ReturnPreviousTask协程, 结果先放在mResult里
+template <class Control, class A>
+struct WhenChild {
+    using RetType = typename AwaitableTraits<A>::RetType;
+    using NonVoidRetType = typename AwaitableTraits<A>::NonVoidRetType;
+
+    explicit WhenChild(std::remove_reference_t<A> &awaitable) : mTask(run(awaitable, *this)) {}
+
+    WhenChild(WhenChild &&) = delete;
+
+    // 准备好, 返回要resume的协程(由调用者resume, 或者作为对称转移的目标)
+    std::coroutine_handle<> prepare(Control &control, std::size_t index, std::stop_token token) noexcept {
+        mControl = &control;
+        mIndex = index;
+        mTask.mCoroutine.promise().mStopToken = std::move(token);
+        return mTask.mCoroutine;
+    }
+
+    // 所有子任务都结束之后才能调用, 子任务抛了异常就在这里重新抛出
+    NonVoidRetType result() {
+        if (mException) [[unlikely]]
+            std::rethrow_exception(mException);
+        return mResult.moveValue();
+    }
+
+    // 没人要的结果(或者异常)取出来丢掉, 结果要析构
+    void discard() noexcept {
+        if (!mException) (void)mResult.moveValue();
+    }
+
+private:
+    static ReturnPreviousTask run(std::remove_reference_t<A> &awaitable, WhenChild &self) {
+        try {
+            // co_await后面如果返回void, putValue收到的就是NonVoidHelper<>
+            self.mResult.putValue((co_await awaitable, NonVoidHelper<>()));
+        } catch (...) {
+            self.mException = std::current_exception();
+        }
+        co_return self.mControl->finish(self.mIndex, self.mException != nullptr);
+    }
+
+    Uninitialized<RetType> mResult;
+    std::exception_ptr mException{};
+    Control *mControl = nullptr;
+    std::size_t mIndex = 0;
+    ReturnPreviousTask mTask;
+};
+
+// Task: 不用额外的协程帧, 子任务结束的时候它的final_suspend直接调用onDone
+template <class Control, ContinuableTask A>
+struct WhenChild<Control, A> : Continuation {
+    using RetType = typename AwaitableTraits<A>::RetType;
+    using NonVoidRetType = typename AwaitableTraits<A>::NonVoidRetType;
+    using promise_type = typename std::remove_cvref_t<A>::promise_type;
+
+    explicit WhenChild(std::remove_reference_t<A> &task) noexcept
+        : Continuation{&onDone}, mCoroutine(task.mCoroutine) {}
+
+    WhenChild(WhenChild &&) = delete;
+
+    std::coroutine_handle<> prepare(Control &control, std::size_t index, std::stop_token token) noexcept {
+        mControl = &control;
+        mIndex = index;
+        promise_type &promise = mCoroutine.promise();
+        promise.mContinuation = this;
+        // 和Task::Awaiter一样, 子任务自己有取消信号就用自己的
+        if (!promise.mStopToken.stop_possible())
+            promise.mStopToken = std::move(token);
+        return mCoroutine;
+    }
+
+    NonVoidRetType result() {
+        if constexpr (std::is_void_v<RetType>) {
+            mCoroutine.promise().result();
+            return NonVoidHelper<>();
+        } else {
+            return mCoroutine.promise().result();
+        }
+    }
+
+    void discard() noexcept {
+        try {
+            (void)result();
+        } catch (...) {
+        }
+    }
+
+private:
+    // onDone返回之后就不能再碰this了: 别的线程上最后一个结束的子任务可能已经回到调用者, 把槽位销毁了
+    static std::coroutine_handle<> onDone(Continuation &self) noexcept {
+        auto &child = static_cast<WhenChild &>(self);
+        return child.mControl->finish(child.mIndex, child.mCoroutine.promise().mException != nullptr);
+    }
+
+    std::coroutine_handle<promise_type> mCoroutine;
+    Control *mControl = nullptr;
+    std::size_t mIndex = 0;
+};
+
+// 依次启动所有子任务, 全部结束之后回到调用者
+template <class Control, class... Children>
+struct WhenChildrenAwaiter {
+    WhenChildrenAwaiter(Control &control, std::tuple<Children...> &children) noexcept
+        : mControl(control), mChildren(children) {}
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> coroutine) {
+        auto &control = mControl;
+        control.mPrevious = coroutine;
+        // 多占一个计数: 启动过程中就算有子任务同步结束, 也不会在后面的子任务启动之前回到调用者
+        control.mPending.store(sizeof...(Children) + 1, std::memory_order_relaxed);
+        [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+            (std::get<Is>(mChildren).prepare(control, Is, control.token()).resume(), ...);
+        }(std::index_sequence_for<Children...>{});
+        // 这之后调用者可能已经被别的线程resume了, 不能再碰this
+        return control.release();
+    }
+
+    void await_resume() const noexcept {}
+
+    Control &mControl;
+    std::tuple<Children...> &mChildren;
+};
+
+// 范围版本(when_all(range)/when_any(range)/when_all_limited): 子任务个数运行时才知道, 槽位放在一个数组里
+// 最多同时跑mLimit个: 启动的时候开mLimit条"车道", 车道上的子任务结束的时候领下一个还没启动的子任务,
+// 直接对称转移过去, 同步结束的子任务一个接一个也不会把栈越压越深
+template <class Base, class A>
+struct WhenRangeCtlBlock : Base {
+    using Child = WhenChild<WhenRangeCtlBlock, A>;
+
+    std::coroutine_handle<> finish(std::size_t index, bool failed) noexcept {
+        this->record(index, failed);
+        // 先领到下一个再减自己的计数: 下一个还没结束, 计数不可能减到0
+        if (auto next = launch()) {
+            this->mPending.fetch_sub(1, std::memory_order_acq_rel);
+            return next;
+        }
+        return this->release();
+    }
+
+    // 领一个还没启动的子任务, 没有了返回空
+    std::coroutine_handle<> launch() noexcept {
+        std::size_t index = mNext.fetch_add(1, std::memory_order_relaxed);
+        if (index >= mSize) return nullptr;
+        return mChildren[index]->prepare(*this, index, this->token());
+    }
+
+    std::optional<Child> *mChildren = nullptr;
+    std::size_t mSize = 0;
+    std::size_t mLimit = 0;
+    std::atomic<std::size_t> mNext{0};
+};
+
+template <class Control>
+struct WhenRangeAwaiter {
+    explicit WhenRangeAwaiter(Control &control) noexcept : mControl(control) {}
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> coroutine) {
+        auto &control = mControl;
+        control.mPrevious = coroutine;
+        control.mPending.store(control.mSize + 1, std::memory_order_relaxed);
+        for (std::size_t lane = 0; lane < control.mLimit; ++lane) {
+            auto child = control.launch();
+            if (!child) break;
+            child.resume();
+        }
+        return control.release();
+    }
+
+    void await_resume() const noexcept {}
+
+    Control &mControl;
+};
+
+// 范围里的元素必须是左值(比如std::vector<Task<T>>), 子任务要活到整个when_all结束
+template <class R>
+concept AwaitableRange = std::ranges::forward_range<R>
+    && std::is_lvalue_reference_v<std::ranges::range_reference_t<R>>
+    && Awaitable<std::ranges::range_reference_t<R>>;
+
+// 把范围里的子任务都放进槽位数组
+template <class Control, class R>
+std::unique_ptr<std::optional<typename Control::Child>[]> whenRangeChildren(Control &control, R &range) {
+    std::size_t n = (std::size_t)std::ranges::distance(range);
+    auto children = std::make_unique<std::optional<typename Control::Child>[]>(n);
+    std::size_t i = 0;
+    for (auto &t : range)
+        children[i++].emplace(t);
+    control.mChildren = children.get();
+    control.mSize = n;
+    return children;
+}
+
+}
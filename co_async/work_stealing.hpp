@@ -0,0 +1,302 @@
+/**
+ * @file work_stealing.hpp
+ * @author qc
+ * @brief 多线程工作窃取调度器
+ * @details runtime.hpp 是每个核一个互不相干的AsyncLoop, 负载不均的时候忙的核忙死,闲的核闲死
+ *          这里N个工作线程共享一批任务:
+ *          1. 每个工作线程一个Chase-Lev双端队列, 自己从底部存取(后进先出,刚产生的任务数据还在缓存里),
+ *             闲下来的线程从别人的顶部偷最老的任务, 偷的时候不加锁
+ *          2. 每个工作线程还有一个LIFO槽, 本线程刚唤醒的协程直接放这里, 下一个就执行它, 连双端队列的原子操作都省了
+ *             为了防止两个协程互相唤醒把别的任务饿死, 连续从LIFO槽里拿到一定次数之后就先去看队列
+ *          3. 不是工作线程提交的任务(比如主线程spawn, IoLoop的事件线程唤醒的协程)放进全局注入队列(加锁)
+ *          4. 什么都拿不到就睡在条件变量上, 有新任务的时候唤醒一个
+ *          工作线程上co_await sleep_for(...)用的是本线程的getTimerLoop(), 工作线程每一轮都会检查自己的定时器
+ *          when_any的赢家在别的线程上结束的时候, 取消输家的sleep会投递回sleep所在的线程(TimerLoop::postCancel)
+ *          IO等待的取消走attach过的IoLoop(共享模式加锁并投递), 没有attach的IoLoop只能在驱动它的线程上取消
+ *          attach(IoLoop)之后, epoll唤醒的协程不在事件线程里直接resume, 而是投递到这里, 哪个工作线程有空就被谁执行
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <thread>
+#include <vector>
+#include <utilities/chase_lev_deque.hpp>
+#include <utilities/uninitialized.hpp>
+#include <utilities/non_void_helper.hpp>
+#include "task.hpp"
+#include "timerLoop.hpp"
+#include "ioLoop.hpp"
+#include "asyncLoop.hpp"
+
+namespace co_async {
+
+struct WorkStealingScheduler {
+    // nthreads为0就用核数
+    explicit WorkStealingScheduler(std::size_t nthreads = 0) {
+        std::size_t n = nthreads ? nthreads : std::max(1u, std::thread::hardware_concurrency());
+        mWorkers.reserve(n);
+        for (std::size_t i = 0; i < n; ++i)
+            mWorkers.push_back(std::make_unique<Worker>());
+        for (std::size_t i = 0; i < n; ++i)
+            mWorkers[i]->mThread = std::jthread([this, i] { workerMain(i); });
+    }
+
+    // 析构的时候还没执行完的任务直接丢掉(帧不释放), 需要结果的任务用block_on等它结束
+    ~WorkStealingScheduler() {
+        {
+            std::lock_guard lock(mParkMutex);
+            mStop.store(true, std::memory_order_release);
+        }
+        mParkCv.notify_all();
+        for (auto *loop : mIoLoops)
+            loop->wakeup();
+        mIoThreads.clear();
+        for (auto &w : mWorkers)
+            w->mThread = std::jthread();
+        for (auto *loop : mIoLoops)
+            loop->setResumeHook(nullptr, nullptr);
+    }
+
+    WorkStealingScheduler &operator=(WorkStealingScheduler &&) = delete;
+
+    std::size_t size() const noexcept {
+        return mWorkers.size();
+    }
+
+    // 让协程在某个工作线程上继续执行, 哪个线程都可以调用
+    void schedule(std::coroutine_handle<> coroutine) {
+        Worker *self = currentWorker();
+        if (self) {
+            // 本线程唤醒的协程放进LIFO槽, 原来在槽里的挤到双端队列里, 可以被偷
+            void *old = self->mLifoSlot.exchange(coroutine.address(), std::memory_order_relaxed);
+            if (!old) return;
+            self->mDeque.push(old);
+        } else {
+            std::lock_guard lock(mInjectMutex);
+            mInjectQueue.push_back(coroutine);
+            mInjectSize.fetch_add(1, std::memory_order_relaxed);
+        }
+        notifyOne();
+    }
+
+    struct ScheduleAwaiter {
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> coroutine) {
+            mScheduler.schedule(coroutine);
+        }
+
+        void await_resume() const noexcept {}
+
+        WorkStealingScheduler &mScheduler;
+    };
+
+    // co_await scheduler.schedule(): 之后的代码在工作线程上执行
+    ScheduleAwaiter schedule() noexcept {
+        return ScheduleAwaiter(*this);
+    }
+
+    // 后台执行,不等结果, 执行完帧自动释放
+    template <class T, class P>
+    void spawn(Task<T, P> &&t) {
+        schedule(detachedHelper(std::move(t)).mCoroutine);
+    }
+
+    // 在调度器上执行t并阻塞等待结果, 不能在工作线程上调用(会占着一个工作线程干等)
+    template <class T, class P>
+    T block_on(Task<T, P> const& t) {
+        Uninitialized<T> result;
+        std::exception_ptr exception;
+        // 不用atomic::wait: 这边一醒来就返回了, 工作线程的notify可能还在碰已经析构的变量
+        std::promise<void> done;
+        auto future = done.get_future();
+        schedule(blockOnHelper(t, result, exception, done).mCoroutine);
+        future.wait();
+        if (exception) [[unlikely]]
+            std::rethrow_exception(exception);
+        if constexpr (!std::is_void_v<T>)
+            return result.moveValue();
+    }
+
+    // 由一个单独的线程跑loop.tryRun(), fd就绪的协程投递到工作线程上执行
+    // 之后loop上的读写/等待可以在任何工作线程上进行, loop要比调度器活得久
+    void attach(IoLoop &loop) {
+        loop.setResumeHook(this, [](void *self, std::coroutine_handle<> coroutine) {
+            static_cast<WorkStealingScheduler *>(self)->schedule(coroutine);
+        });
+        mIoLoops.push_back(&loop);
+        mIoThreads.emplace_back([this, &loop] {
+            // 带deadline的IO等待的超时也由这个线程触发(挂在loop自己的TimerLoop上)
+            while (!mStop.load(std::memory_order_acquire))
+                loop.tryRun(loop.runTimers());
+        });
+    }
+
+private:
+    struct Worker {
+        ChaseLevDeque<void *> mDeque;
+        std::atomic<void *> mLifoSlot{nullptr};
+        std::jthread mThread;
+    };
+
+    // 连续执行LIFO槽里的协程最多这么多次
+    static constexpr std::size_t kMaxLifoStreak = 3;
+    // 每隔这么多轮先看一次注入队列, 不然本地一直有活的时候外面提交的任务会饿死
+    static constexpr std::size_t kInjectInterval = 61;
+    // 睡之前先空转几轮去偷
+    static constexpr std::size_t kSpinRounds = 16;
+
+    static Worker *&currentWorkerSlot() noexcept {
+        static thread_local Worker *worker = nullptr;
+        return worker;
+    }
+
+    static WorkStealingScheduler *&currentSchedulerSlot() noexcept {
+        static thread_local WorkStealingScheduler *scheduler = nullptr;
+        return scheduler;
+    }
+
+    // 当前线程是本调度器的工作线程才返回非空
+    Worker *currentWorker() const noexcept {
+        return currentSchedulerSlot() == this ? currentWorkerSlot() : nullptr;
+    }
+
+    template <class T, class P>
+    static DetachedTask blockOnHelper(Task<T, P> const& t, Uninitialized<T> &result,
+                                      std::exception_ptr &exception, std::promise<void> &done) {
+        try {
+            result.putValue((co_await t, NonVoidHelper<>()));
+        } catch (...) {
+            exception = std::current_exception();
+        }
+        done.set_value();
+    }
+
+    std::coroutine_handle<> popInject() {
+        if (mInjectSize.load(std::memory_order_relaxed) == 0) return nullptr;
+        std::lock_guard lock(mInjectMutex);
+        if (mInjectQueue.empty()) return nullptr;
+        auto coroutine = mInjectQueue.front();
+        mInjectQueue.pop_front();
+        mInjectSize.fetch_sub(1, std::memory_order_relaxed);
+        return coroutine;
+    }
+
+    std::coroutine_handle<> steal(std::size_t self, std::minstd_rand &rng) {
+        std::size_t n = mWorkers.size();
+        std::size_t start = rng() % n;
+        for (std::size_t k = 0; k < n; ++k) {
+            std::size_t victim = (start + k) % n;
+            if (victim == self) continue;
+            if (auto p = mWorkers[victim]->mDeque.steal())
+                return std::coroutine_handle<>::from_address(*p);
+        }
+        return nullptr;
+    }
+
+    std::coroutine_handle<> findTask(std::size_t index, std::size_t tick, std::size_t &lifoStreak, std::minstd_rand &rng) {
+        Worker &self = *mWorkers[index];
+        if (tick % kInjectInterval == 0)
+            if (auto coroutine = popInject()) return coroutine;
+        if (lifoStreak < kMaxLifoStreak) {
+            if (void *p = self.mLifoSlot.exchange(nullptr, std::memory_order_relaxed)) {
+                ++lifoStreak;
+                return std::coroutine_handle<>::from_address(p);
+            }
+        }
+        lifoStreak = 0;
+        if (auto p = self.mDeque.pop())
+            return std::coroutine_handle<>::from_address(*p);
+        if (void *p = self.mLifoSlot.exchange(nullptr, std::memory_order_relaxed))
+            return std::coroutine_handle<>::from_address(p);
+        if (auto coroutine = popInject()) return coroutine;
+        return steal(index, rng);
+    }
+
+    bool hasWork() const noexcept {
+        if (mInjectSize.load(std::memory_order_relaxed) != 0) return true;
+        for (auto &w : mWorkers)
+            if (!w->mDeque.empty()) return true;
+        return false;
+    }
+
+    void notifyOne() {
+        // 和park里的 mSleepers++ 再检查hasWork 配对, 两边都是seq_cst, 不会两边都没看到对方
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (mSleepers.load(std::memory_order_relaxed) == 0) return;
+        std::lock_guard lock(mParkMutex);
+        mParkCv.notify_one();
+    }
+
+    void park(std::optional<TimerLoop::Clock::duration> timeout) {
+        std::unique_lock lock(mParkMutex);
+        mSleepers.fetch_add(1, std::memory_order_seq_cst);
+        if (!hasWork() && !mStop.load(std::memory_order_relaxed) && !getTimerLoop().hasRemote()) {
+            if (timeout) mParkCv.wait_for(lock, *timeout);
+            else mParkCv.wait(lock);
+        }
+        mSleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void workerMain(std::size_t index) {
+        currentWorkerSlot() = mWorkers[index].get();
+        currentSchedulerSlot() = this;
+        // 别的线程上的when_any取消了这个线程上的sleep: 投递之后要把睡在条件变量上的本线程叫醒
+        getTimerLoop().setWakeup(this, [](void *self) {
+            auto *scheduler = static_cast<WorkStealingScheduler *>(self);
+            std::lock_guard lock(scheduler->mParkMutex);
+            scheduler->mParkCv.notify_all();
+        });
+        std::minstd_rand rng((unsigned)index + 1);
+        std::size_t lifoStreak = 0;
+        std::size_t idleRounds = 0;
+        for (std::size_t tick = 1; !mStop.load(std::memory_order_acquire); ++tick) {
+            // 本线程上sleep_for的协程
+            auto timeout = getTimerLoop().run();
+            if (auto coroutine = findTask(index, tick, lifoStreak, rng)) {
+                idleRounds = 0;
+                coroutine.resume();
+                continue;
+            }
+            if (++idleRounds < kSpinRounds) {
+                std::this_thread::yield();
+                continue;
+            }
+            idleRounds = 0;
+            park(timeout);
+        }
+        currentWorkerSlot() = nullptr;
+        currentSchedulerSlot() = nullptr;
+    }
+
+    std::vector<std::unique_ptr<Worker>> mWorkers;
+
+    std::mutex mInjectMutex;
+    std::deque<std::coroutine_handle<>> mInjectQueue;
+    std::atomic<std::size_t> mInjectSize{0};
+
+    std::mutex mParkMutex;
+    std::condition_variable mParkCv;
+    std::atomic<std::size_t> mSleepers{0};
+    std::atomic<bool> mStop{false};
+
+    std::vector<IoLoop *> mIoLoops;
+    std::vector<std::jthread> mIoThreads;
+};
+
+}
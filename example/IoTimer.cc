@@ -72,7 +72,10 @@ int main() {
     auto t = async_main();
     t.mCoroutine.resume();
     while (!t.mCoroutine.done()) {
-        if (auto delay = timerLoop.run()) {
+        // 被when_any取消的sleep要到下一次run()才结束, 协程可能就在这里跑完, 不能再去无限期地等epoll
+        auto delay = timerLoop.run();
+        if (t.mCoroutine.done()) break;
+        if (delay) {
             epollLoop.tryRun(delay);
         } else {
             epollLoop.tryRun();
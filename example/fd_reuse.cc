@@ -0,0 +1,108 @@
+#include <chrono>
+#include <iostream>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <co_async/task.hpp>
+#include <co_async/ioLoop.hpp>
+#include <co_async/when_all.hpp>
+#include <co_async/asyncLoop.hpp>
+
+using namespace co_async;
+using namespace std::chrono_literals;
+
+// fd关闭之后内核会把同一个号码给下一个打开的文件
+// 用close_file关: 先从IoLoop里摘掉登记项再close, 新文件重新注册进epoll, 读写不会挂住
+// 直接close的话新文件会继承旧的登记状态(已经注册过/已经读空), 等待永远不会被唤醒
+
+Task<void> writeLater(AsyncLoop &loop, int fd) {
+    co_await sleep_for(loop, 1ms);
+    [[maybe_unused]] auto n = write(fd, "ping", 4);
+}
+
+Task<int> readOnce(IoLoop &loop, AsyncFile &file) {
+    char buf[8];
+    // 挂住了就超时, 不会让例子卡死
+    co_return (int)co_await read_file(loop, file, buf, std::chrono::steady_clock::now() + 1s);
+}
+
+Task<int> reuse(AsyncLoop &loop, int rounds) {
+    IoLoop &ioLoop = loop;
+    int reused = 0;
+    int lastFd = -1;
+    for (int i = 0; i < rounds; ++i) {
+        int p[2];
+        checkError(pipe(p));
+        if (p[0] == lastFd) ++reused;
+        lastFd = p[0];
+        AsyncFile rd(p[0]);
+        // 先读空(EAGAIN)挂起, 登记项记下了已注册/已读空
+        auto [n, _] = co_await when_all(readOnce(ioLoop, rd), writeLater(loop, p[1]));
+        if (n != 4) throw std::runtime_error("short read");
+        close_file(ioLoop, rd);
+        close(p[1]);
+    }
+    co_return reused;
+}
+
+// 同一批事件里关掉别的fd: 两个socketpair的对端同时关闭, 两个HUP在同一次epoll_wait里取回来,
+// 先被唤醒的协程把两个fd都close_file掉, 再新开socket直到拿到第二个fd原来的号码
+// 这一批里属于旧文件的HUP不能落到新socket上, 否则新socket上的等待马上返回, read_file一直空转, deadline也不会触发
+// sameBatch: 新socket马上在这一批里等待(注册发生在这一批分发的过程中); 否则等到下一轮再用
+Task<bool> closeInSameBatch(AsyncLoop &loop, bool sameBatch) {
+    IoLoop &ioLoop = loop;
+    int a[2], b[2];
+    checkError(socketpair(AF_UNIX, SOCK_STREAM, 0, a));
+    checkError(socketpair(AF_UNIX, SOCK_STREAM, 0, b));
+    AsyncFile a0(a[0]), b0(b[0]);
+    // 两边都先读一次, 关闭之前就登记进epoll, a0的HUP才会排在b0前面; b0之后没有协程在上面等
+    char buf[8];
+    for (auto [file, peer] : {std::pair{&a0, a[1]}, std::pair{&b0, b[1]}}) {
+        checkError(write(peer, "x", 1));
+        co_await read_file(ioLoop, *file, buf);
+    }
+    close(a[1]);
+    close(b[1]);
+    co_await wait_file_event(ioLoop, a0, EPOLLIN);
+    int oldFd = b0.fileNo();
+    close_file(ioLoop, a0);
+    close_file(ioLoop, b0);
+    std::vector<int> fds;
+    AsyncFile reused;
+    while (reused.fileNo() == -1 && fds.size() < 16) {
+        int s[2];
+        checkError(socketpair(AF_UNIX, SOCK_STREAM, 0, s));
+        fds.insert(fds.end(), {s[0], s[1]});
+        for (int fd : s)
+            if (fd == oldFd) reused = AsyncFile(fd);
+    }
+    if (!sameBatch) co_await sleep_for(loop, 1ms);
+    bool timedOut = false;
+    if (reused.fileNo() != -1) {
+        try {
+            co_await read_file(ioLoop, reused, buf, std::chrono::steady_clock::now() + 50ms);
+        } catch (std::system_error const &e) {
+            if (e.code().value() != ETIMEDOUT) throw;
+            timedOut = true;
+        }
+        ioLoop.removeListener(reused);
+    }
+    for (int fd : fds) close(fd);
+    co_return timedOut;
+}
+
+int main() {
+    AsyncLoop loop;
+    try {
+        int reused = run_task(loop, reuse(loop, 100));
+        std::cout << "100 rounds, fd number reused " << reused << " times" << std::endl;
+        bool sameBatch = run_task(loop, closeInSameBatch(loop, true));
+        bool nextBatch = run_task(loop, closeInSameBatch(loop, false));
+        std::cout << "stale HUP after close in the same batch: " << (sameBatch && nextBatch ? "ignored" : "LEAKED")
+                  << std::endl;
+        return reused > 0 && sameBatch && nextBatch ? 0 : 1;
+    } catch (std::exception const &e) {
+        std::cout << "fd_reuse: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,66 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <co_async/task.hpp>
+#include <co_async/ioLoop.hpp>
+#include <co_async/socket.hpp>
+#include <co_async/runtime.hpp>
+
+using namespace co_async;
+using namespace std::chrono_literals;
+
+// Runtime::serve 做echo服务器: 每个线程一个SO_REUSEPORT监听套接字, 连接留在accept它的线程上
+// handler返回之后serve负责关闭连接(close_file), handler里不用关
+// serve不会返回, 客户端线程检查完所有回显之后直接结束进程
+
+Task<void> echo(AsyncLoop &loop, AsyncFile conn) {
+    IoLoop &ioLoop = loop;
+    char buf[4096];
+    while (auto n = co_await read_file(ioLoop, conn, buf)) {
+        std::size_t off = 0;
+        while (off < n)
+            off += co_await write_file(ioLoop, conn, std::span<char const>(buf + off, n - off));
+    }
+}
+
+// 阻塞的客户端, 返回回显不对的连接数
+int runClients(int port, int count) {
+    auto addr = socket_address(ip_address("127.0.0.1"), port);
+    int bad = 0;
+    for (int i = 0; i < count; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        timeval tv{2, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        // 服务器线程可能还没开始监听
+        int tries = 0;
+        while (connect(fd, (sockaddr *)&addr.mAddr, addr.mAddrLen) == -1 && ++tries < 100)
+            std::this_thread::sleep_for(10ms);
+        std::string msg = "hello " + std::to_string(i);
+        std::string got;
+        if (write(fd, msg.data(), msg.size()) == (ssize_t)msg.size()) {
+            shutdown(fd, SHUT_WR);
+            char buf[64];
+            ssize_t n;
+            while ((n = read(fd, buf, sizeof(buf))) > 0) got.append(buf, n);
+        }
+        if (got != msg) ++bad;
+        close(fd);
+    }
+    return bad;
+}
+
+int main() {
+    int port = 20000 + getpid() % 20000;
+    std::jthread client([port] {
+        int bad = runClients(port, 100);
+        std::cout << "100 connections, " << bad << " bad echoes" << std::endl;
+        std::_Exit(bad ? 1 : 0);
+    });
+    Runtime runtime(2, false);
+    runtime.serve(socket_address(ip_address("127.0.0.1"), port), echo);
+    return 1;
+}
@@ -0,0 +1,90 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <co_async/task.hpp>
+#include <co_async/ioLoop.hpp>
+#include <co_async/when_all.hpp>
+#include <co_async/socket.hpp>
+#include <co_async/transfer.hpp>
+#include <co_async/asyncLoop.hpp>
+
+using namespace co_async;
+
+// 文件 -> socket: transfer用sendfile, 数据从页缓存直接进socket, 不经过用户态缓冲区
+// 对端一边收一边校验, socket缓冲区满了transfer就挂起等EPOLLOUT
+
+Task<std::string> receive(IoLoop &loop, AsyncFile &sock, std::size_t size) {
+    std::string out;
+    char buf[65536];
+    while (out.size() < size) {
+        auto n = co_await read_file(loop, sock, buf);
+        if (n == 0) break;
+        out.append(buf, n);
+    }
+    co_return out;
+}
+
+Task<bool> sendFile(AsyncLoop &loop, std::string const &data) {
+    IoLoop &ioLoop = loop;
+    char path[] = "/tmp/co_async_transferXXXXXX";
+    AsyncFile file(checkError(mkstemp(path)));
+    unlink(path);
+    checkError(write(file.fileNo(), data.data(), data.size()));
+    int sv[2];
+    checkError(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv));
+    AsyncFile tx(sv[0]), rx(sv[1]);
+    // 先发后半段(从offset开始, 不动文件偏移), 再从头发整个文件
+    std::size_t half = data.size() / 2;
+    auto [n1, got1] = co_await when_all(transfer(ioLoop, file, tx, (off_t)half), receive(ioLoop, rx, data.size() - half));
+    auto [n2, got2] = co_await when_all(transfer(ioLoop, file, tx, 0), receive(ioLoop, rx, data.size()));
+    close_file(ioLoop, tx);
+    close_file(ioLoop, rx);
+    close_file(ioLoop, file);
+    co_return n1 == data.size() - half && got1 == data.substr(half) && n2 == data.size() && got2 == data;
+}
+
+// TCP连接上连续transfer两次, 再在同一个socket上write_file
+// 文件比socket缓冲区小, sendfile一次就搬完, socket一直可写, TCP不会再给EPOLLOUT边沿
+// 所以搬到文件末尾不能当成写满, 否则第二次transfer和之后的write_file会一直等到超时
+Task<bool> sendFileTcp(AsyncLoop &loop, std::string const &data) {
+    using namespace std::chrono_literals;
+    IoLoop &ioLoop = loop;
+    char path[] = "/tmp/co_async_transferXXXXXX";
+    AsyncFile file(checkError(mkstemp(path)));
+    unlink(path);
+    checkError(write(file.fileNo(), data.data(), data.size()));
+    auto serv = co_await create_tcp_server(ioLoop, socket_address(ip_address("127.0.0.1"), 0));
+    auto client = co_await create_tcp_client(ioLoop, socketGetAddress(serv));
+    auto [conn, addr] = co_await socket_accept<SocketAddress>(ioLoop, serv);
+    auto deadline = std::chrono::steady_clock::now() + 2s;
+    bool ok = true;
+    for (int i = 0; i < 2; ++i) {
+        auto [n, got] = co_await when_all(transfer(ioLoop, file, conn, 0, kTransferToEof, deadline),
+                                          receive(ioLoop, client, data.size()));
+        ok = ok && n == data.size() && got == data;
+    }
+    std::string tail = "done";
+    auto [n, got] = co_await when_all(write_file(ioLoop, conn, tail, deadline), receive(ioLoop, client, tail.size()));
+    ok = ok && n == tail.size() && got == tail;
+    close_file(ioLoop, conn);
+    close_file(ioLoop, client);
+    close_file(ioLoop, serv);
+    close_file(ioLoop, file);
+    co_return ok;
+}
+
+int main() {
+    std::string data;
+    for (std::size_t i = 0; i < (4u << 20); ++i)
+        data.push_back((char)(i * 2654435761u >> 24));
+    AsyncLoop loop;
+    auto t0 = std::chrono::steady_clock::now();
+    bool ok = run_task(loop, sendFile(loop, data));
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+    std::cout << "transfer " << data.size() * 3 / 2 << " bytes " << (ok ? "ok" : "MISMATCH") << " in " << ms << "ms" << std::endl;
+    bool tcpOk = run_task(loop, sendFileTcp(loop, data.substr(0, 4096)));
+    std::cout << "tcp: transfer twice then write " << (tcpOk ? "ok" : "FAILED") << std::endl;
+    return ok && tcpOk ? 0 : 1;
+}
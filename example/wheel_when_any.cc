@@ -0,0 +1,39 @@
+#include <chrono>
+#include <iostream>
+#include <variant>
+#include <co_async/task.hpp>
+#include <co_async/when_any.hpp>
+#include <co_async/timerLoop.hpp>
+#include <co_async/asyncLoop.hpp>
+
+using namespace co_async;
+using namespace std::chrono_literals;
+
+// 时间轮上同一个tick到期的几个sleep一起when_any:
+// run()把它们一起收到到期链表里, 第一个resume之后when_any取消其余的, 这时它们还在链表上等着被触发,
+// 取消不能再把它们插回轮子里(否则同一个节点同时挂在两条链表上)
+// 再混一个带取消的长sleep, 输掉之后要马上被取消
+Task<int> equalDeadlines(AsyncLoop &loop, int rounds) {
+    int finished = 0;
+    for (int i = 0; i < rounds; ++i) {
+        auto deadline = std::chrono::steady_clock::now() + 2ms;
+        auto v = co_await when_any(sleep_until(loop, deadline), sleep_until(loop, deadline),
+                                   sleep_until(loop, deadline), sleep_for(loop, 1h));
+        if (v.index() != 3) ++finished;
+    }
+    co_return finished;
+}
+
+int main() {
+    int failed = 0;
+    for (auto backend : {TimerBackend::Wheel, TimerBackend::RbTree}) {
+        AsyncLoop loop(backend);
+        auto t0 = std::chrono::steady_clock::now();
+        int finished = run_task(loop, equalDeadlines(loop, 100));
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+        std::cout << (backend == TimerBackend::Wheel ? "wheel" : "rbtree") << ": " << finished
+                  << "/100 in " << ms << "ms" << std::endl;
+        if (finished != 100) ++failed;
+    }
+    return failed;
+}
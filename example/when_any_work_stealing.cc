@@ -0,0 +1,57 @@
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <iostream>
+#include <thread>
+#include <variant>
+#include <co_async/task.hpp>
+#include <co_async/when_any.hpp>
+#include <co_async/when_all.hpp>
+#include <co_async/timerLoop.hpp>
+#include <co_async/work_stealing.hpp>
+
+using namespace co_async;
+using namespace std::chrono_literals;
+
+// 工作窃取调度器上的when_any: sleep挂在某个工作线程的TimerLoop上, 赢家却在另一个线程上结束,
+// 输掉的sleep要在它自己的线程上被取消(投递回去), 不能在赢家的线程上直接改那个TimerLoop
+
+// 从一个新线程resume, 赢家的when_any取消就是在这个线程上发起的
+struct ResumeOnOtherThread {
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> coroutine) {
+        std::thread([coroutine] {
+            std::this_thread::sleep_for(1ms);
+            coroutine.resume();
+        }).detach();
+    }
+
+    void await_resume() const noexcept {}
+};
+
+Task<int> fromOtherThread() {
+    co_await ResumeOnOtherThread{};
+    co_return 42;
+}
+
+std::atomic<int> gDone{0};
+
+Task<void> race(WorkStealingScheduler &scheduler, int rounds) {
+    for (int i = 0; i < rounds; ++i) {
+        co_await scheduler.schedule();
+        auto v = co_await when_any(sleep_for(1h), fromOtherThread());
+        if (v.index() != 1 || std::get<1>(v) != 42)
+            throw std::runtime_error("when_any: wrong winner");
+        ++gDone;
+    }
+}
+
+int main() {
+    WorkStealingScheduler scheduler(4);
+    auto t0 = std::chrono::steady_clock::now();
+    scheduler.block_on(when_all(race(scheduler, 50), race(scheduler, 50), race(scheduler, 50), race(scheduler, 50)));
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+    std::cout << gDone << " when_any finished in " << ms << "ms" << std::endl;
+    return gDone == 200 ? 0 : 1;
+}
@@ -0,0 +1,65 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <unistd.h>
+#include <co_async/task.hpp>
+#include <co_async/ioLoop.hpp>
+#include <co_async/when_all.hpp>
+#include <co_async/work_stealing.hpp>
+
+using namespace co_async;
+using namespace std::chrono_literals;
+
+// 一个IoLoop attach到工作窃取调度器上, 工作线程上带deadline的读:
+// 超时节点挂在IoLoop自己的TimerLoop上(由IO线程触发), 协程在哪个工作线程上醒来都能安全地摘掉它
+// 一半的管道有别的线程写数据(读到), 另一半没人写(超时)
+
+std::atomic<int> gRead{0};
+std::atomic<int> gTimedOut{0};
+
+Task<void> readWithDeadline(WorkStealingScheduler &scheduler, IoLoop &loop, int i) {
+    int p[2];
+    checkError(pipe(p));
+    AsyncFile rd(p[0]);
+    co_await scheduler.schedule();
+    if (i % 2) {
+        std::thread([fd = p[1]] {
+            std::this_thread::sleep_for(2ms);
+            [[maybe_unused]] auto n = write(fd, "x", 1);
+        }).detach();
+    }
+    char buf[4];
+    try {
+        co_await read_file(loop, rd, buf, std::chrono::steady_clock::now() + std::chrono::milliseconds(10 + i % 7));
+        ++gRead;
+    } catch (std::system_error const &e) {
+        if (e.code().value() != ETIMEDOUT) throw;
+        ++gTimedOut;
+    }
+    // 换一个工作线程再关
+    co_await scheduler.schedule();
+    close_file(loop, rd);
+    // 写线程可能还没写完
+    std::this_thread::sleep_for(5ms);
+    close(p[1]);
+}
+
+Task<void> worker(WorkStealingScheduler &scheduler, IoLoop &loop, int base) {
+    for (int i = 0; i < 20; ++i)
+        co_await readWithDeadline(scheduler, loop, base + i);
+}
+
+int main() {
+    IoLoop loop;
+    int rc;
+    {
+        WorkStealingScheduler scheduler(4);
+        scheduler.attach(loop);
+        scheduler.block_on(when_all(worker(scheduler, loop, 0), worker(scheduler, loop, 100),
+                                    worker(scheduler, loop, 200), worker(scheduler, loop, 300)));
+        std::cout << "read " << gRead << ", timed out " << gTimedOut << std::endl;
+        rc = gRead == 40 && gTimedOut == 40 ? 0 : 1;
+    }
+    return rc;
+}
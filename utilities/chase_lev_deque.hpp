@@ -0,0 +1,126 @@
+/**
+ * @file chase_lev_deque.hpp
+ * @author qc
+ * @brief Chase-Lev 无锁工作窃取双端队列
+ * @details 只有所有者线程能在底部push/pop(后进先出,缓存友好),其他线程只能从顶部steal(先进先出,偷最老的)
+ *          按照 Lê, Pop, Cohen, Zappa Nardelli. "Correct and Efficient Work-Stealing for Weak Memory Models" 实现
+ *          数组满了翻倍扩容,旧数组可能还有小偷在读,所以不马上释放,等队列析构的时候一起释放
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+#include <type_traits>
+
+namespace co_async {
+
+template <class T>
+struct ChaseLevDeque {
+    static_assert(std::is_trivially_copyable_v<T>, "ChaseLevDeque only stores trivially copyable values");
+
+    explicit ChaseLevDeque(std::size_t capacity = 256) {
+        std::size_t cap = 1;
+        while (cap < capacity) cap <<= 1;
+        auto array = std::make_unique<Array>(cap);
+        mArray.store(array.get(), std::memory_order_relaxed);
+        mArrays.push_back(std::move(array));
+    }
+
+    ChaseLevDeque(ChaseLevDeque &&) = delete;
+
+    // 只能由所有者线程调用
+    void push(T value) {
+        std::int64_t b = mBottom.load(std::memory_order_relaxed);
+        std::int64_t t = mTop.load(std::memory_order_acquire);
+        Array *array = mArray.load(std::memory_order_relaxed);
+        if (b - t > (std::int64_t)array->mMask) [[unlikely]] {
+            array = grow(array, t, b);
+        }
+        array->put(b, value);
+        // release: 小偷acquire读到新的mBottom之后, 一定能看到这个元素以及协程帧里之前写的东西
+        mBottom.store(b + 1, std::memory_order_release);
+    }
+
+    // 只能由所有者线程调用, 取最新放进去的
+    std::optional<T> pop() {
+        std::int64_t b = mBottom.load(std::memory_order_relaxed) - 1;
+        Array *array = mArray.load(std::memory_order_relaxed);
+        mBottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t t = mTop.load(std::memory_order_relaxed);
+        if (t > b) {
+            // 空的
+            mBottom.store(b + 1, std::memory_order_relaxed);
+            return std::nullopt;
+        }
+        T value = array->get(b);
+        if (t == b) {
+            // 只剩最后一个, 和小偷抢
+            bool won = mTop.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            mBottom.store(b + 1, std::memory_order_relaxed);
+            if (!won) return std::nullopt;
+        }
+        return value;
+    }
+
+    // 任何线程都可以调用, 取最老的
+    std::optional<T> steal() {
+        std::int64_t t = mTop.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t b = mBottom.load(std::memory_order_acquire);
+        if (t >= b) return std::nullopt;
+        Array *array = mArray.load(std::memory_order_acquire);
+        T value = array->get(t);
+        if (!mTop.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return std::nullopt; // 被别人抢走了
+        return value;
+    }
+
+    // 近似值, 只用来判断要不要去偷/要不要睡
+    bool empty() const noexcept {
+        return mBottom.load(std::memory_order_relaxed) <= mTop.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Array {
+        explicit Array(std::size_t capacity)
+            : mMask(capacity - 1), mData(std::make_unique<std::atomic<T>[]>(capacity)) {}
+
+        T get(std::int64_t i) const noexcept {
+            return mData[i & mMask].load(std::memory_order_relaxed);
+        }
+
+        void put(std::int64_t i, T value) noexcept {
+            mData[i & mMask].store(value, std::memory_order_relaxed);
+        }
+
+        std::size_t mMask;
+        std::unique_ptr<std::atomic<T>[]> mData;
+    };
+
+    Array *grow(Array *old, std::int64_t t, std::int64_t b) {
+        auto array = std::make_unique<Array>((old->mMask + 1) * 2);
+        for (std::int64_t i = t; i < b; ++i)
+            array->put(i, old->get(i));
+        Array *raw = array.get();
+        mArrays.push_back(std::move(array));
+        mArray.store(raw, std::memory_order_release);
+        return raw;
+    }
+
+    alignas(64) std::atomic<std::int64_t> mTop{0};
+    alignas(64) std::atomic<std::int64_t> mBottom{0};
+    std::atomic<Array *> mArray;
+    // 所有用过的数组, 只有所有者线程会修改
+    std::vector<std::unique_ptr<Array>> mArrays;
+};
+
+}
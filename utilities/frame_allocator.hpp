@@ -0,0 +1,247 @@
+/**
+ * @file frame_allocator.hpp
+ * @author qc
+ * @brief 协程帧分配器: 线程局部的按大小分级的空闲链表
+ * @details 每次调用一个Task协程都要new一个协程帧, co_return之后马上又delete掉, 请求路径上全是这种短命的帧
+ *          这里按64字节一级分成若干级, 每个线程每一级一条空闲链表, 释放的帧挂回链表, 下次同样大小的帧直接拿走,
+ *          不加锁也不进malloc. 超过最大一级的帧还是走全局operator new
+ *          帧在A线程分配在B线程释放(工作窃取)也没关系, 每一块都是单独从operator new拿的, 挂到B的链表上就归B了,
+ *          每级缓存的块数有上限, 不会因为一直单向流动无限增长
+ *          也可以给协程传 (std::allocator_arg, memory_resource *) 作为头两个参数, 帧就从这个memory_resource分配
+ *          (成员函数协程是this后面的两个参数), 释放的时候要知道是谁分配的, 所以每个帧末尾多放一个指针
+ *          定义 CO_ASYNC_NO_FRAME_POOL 可以关掉缓存, 直接走operator new(用ASan查帧的use-after-free的时候有用)
+ *          请求级arena: 根任务挂一个memory_resource(见run_task/co_spawn的arena版本), 它下面所有协程创建的帧都从这里分配.
+ *          帧是在调用者的函数体里分配的, 所以用一个线程局部的"当前arena": 协程每次被resume就换成自己的, 每次挂起/结束就清空,
+ *          不管是事件循环/定时器/when_all哪个来resume, 协程外面的普通代码看到的都是空的
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#pragma once
+
+#include <array>
+#include <coroutine>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <memory_resource>
+#include <new>
+
+namespace co_async {
+
+struct FramePool {
+    // 每级相差64字节, 64级, 最大4096字节
+    static constexpr std::size_t kStep = 64;
+    static constexpr std::size_t kClasses = 64;
+    // 每级最多缓存这么多块, 多出来的还给operator new
+    static constexpr std::size_t kMaxCached = 256;
+
+    static void *allocate(std::size_t size) {
+#ifndef CO_ASYNC_NO_FRAME_POOL
+        std::size_t c = classOf(size);
+        if (c < kClasses) {
+            if (FramePool *pool = local()) {
+                if (FreeNode *node = pool->mFree[c]) {
+                    pool->mFree[c] = node->mNext;
+                    --pool->mCached[c];
+                    return node;
+                }
+            }
+            return ::operator new((c + 1) * kStep);
+        }
+#endif
+        return ::operator new(size);
+    }
+
+    static void deallocate(void *ptr, std::size_t size) noexcept {
+#ifndef CO_ASYNC_NO_FRAME_POOL
+        std::size_t c = classOf(size);
+        if (c < kClasses) {
+            FramePool *pool = local();
+            if (pool && pool->mCached[c] < kMaxCached) {
+                auto *node = static_cast<FreeNode *>(ptr);
+                node->mNext = pool->mFree[c];
+                pool->mFree[c] = node;
+                ++pool->mCached[c];
+                return;
+            }
+        }
+#endif
+        ::operator delete(ptr);
+    }
+
+    FramePool() = default;
+
+    FramePool(FramePool &&) = delete;
+
+    ~FramePool() {
+        dead() = true;
+        for (auto *&head : mFree) {
+            while (head) {
+                FreeNode *next = head->mNext;
+                ::operator delete(head);
+                head = next;
+            }
+        }
+    }
+
+private:
+    struct FreeNode {
+        FreeNode *mNext;
+    };
+
+    static std::size_t classOf(std::size_t size) noexcept {
+        return (size - 1) / kStep;
+    }
+
+    // 线程退出的时候池子已经析构了, 之后(别的thread_local析构时)释放的帧直接还给operator delete
+    static bool &dead() noexcept {
+        static thread_local bool flag = false;
+        return flag;
+    }
+
+    static FramePool *local() noexcept {
+        if (dead()) [[unlikely]] return nullptr;
+        static thread_local FramePool pool;
+        return &pool;
+    }
+
+    std::array<FreeNode *, kClasses> mFree{};
+    std::array<std::size_t, kClasses> mCached{};
+};
+
+// 当前线程上正在执行的协程属于哪个arena, 空指针表示没有(帧走FramePool)
+struct FrameArena {
+    static std::pmr::memory_resource *&current() noexcept {
+        static constinit thread_local std::pmr::memory_resource *arena = nullptr;
+        return arena;
+    }
+
+    // 同步代码里临时换掉当前arena, 比如在请求里面创建一个要比请求活得长的任务: FrameArena::Scope _(nullptr);
+    struct Scope {
+        explicit Scope(std::pmr::memory_resource *arena) noexcept : mSaved(current()) {
+            current() = arena;
+        }
+
+        Scope(Scope &&) = delete;
+
+        ~Scope() {
+            current() = mSaved;
+        }
+
+        std::pmr::memory_resource *mSaved;
+    };
+};
+
+// 流的缓冲区: 有当前arena就从arena分配, 跟着请求一起释放, 否则和原来一样new char[]
+struct ArenaBufferDeleter {
+    void operator()(char *ptr) const noexcept {
+        if (mResource) mResource->deallocate(ptr, mSize, alignof(std::max_align_t));
+        else delete[] ptr;
+    }
+
+    std::pmr::memory_resource *mResource = nullptr;
+    std::size_t mSize = 0;
+};
+
+using ArenaBuffer = std::unique_ptr<char[], ArenaBufferDeleter>;
+
+inline ArenaBuffer makeArenaBuffer(std::size_t size) {
+    if (auto *arena = FrameArena::current())
+        return ArenaBuffer(static_cast<char *>(arena->allocate(size, alignof(std::max_align_t))), {arena, size});
+    return ArenaBuffer(new char[size]);
+}
+
+// Promise继承它就有了类级别的operator new/delete, 协程帧都从FramePool或者调用者给的memory_resource分配
+struct PooledFrame {
+    static void *operator new(std::size_t size) {
+        return allocateWith(size, FrameArena::current());
+    }
+
+    // 协程第一个参数是std::allocator_arg, 第二个是memory_resource *
+    template <class... Args>
+    static void *operator new(std::size_t size, std::allocator_arg_t, std::pmr::memory_resource *resource, Args const&...) {
+        return allocateWith(size, resource);
+    }
+
+    // 成员函数协程, 第一个参数是对象本身
+    template <class Self, class... Args>
+    static void *operator new(std::size_t size, Self const&, std::allocator_arg_t, std::pmr::memory_resource *resource, Args const&...) {
+        return allocateWith(size, resource);
+    }
+
+    static void operator delete(void *ptr, std::size_t size) noexcept {
+        std::size_t offset = tagOffset(size);
+        std::pmr::memory_resource *resource;
+        std::memcpy(&resource, static_cast<char *>(ptr) + offset, sizeof(resource));
+        if (resource) resource->deallocate(ptr, offset + sizeof(resource), alignof(std::max_align_t));
+        else FramePool::deallocate(ptr, offset + sizeof(resource));
+    }
+
+    // 这个协程里创建的帧从哪里分配, 构造的时候就是调用者的arena, 根任务由run_task/co_spawn改掉
+    std::pmr::memory_resource *mArena = FrameArena::current();
+
+    // co_await的包装: 挂起之前清空当前arena, resume回来换成自己的
+    template <class A>
+    struct ArenaAwaiter {
+        bool await_ready() {
+            return mAwaiter.await_ready();
+        }
+
+        template <class P>
+        decltype(auto) await_suspend(std::coroutine_handle<P> coroutine) {
+            FrameArena::current() = nullptr;
+            return mAwaiter.await_suspend(coroutine);
+        }
+
+        decltype(auto) await_resume() {
+            FrameArena::current() = mArena;
+            return mAwaiter.await_resume();
+        }
+
+        // 直接co_await的等待者存引用(临时对象活到整个co_await表达式结束), operator co_await返回的存值
+        A mAwaiter;
+        std::pmr::memory_resource *mArena;
+    };
+
+    template <class A>
+    auto await_transform(A &&a) {
+        if constexpr (requires { std::forward<A>(a).operator co_await(); }) {
+            using Awaiter = decltype(std::forward<A>(a).operator co_await());
+            return ArenaAwaiter<Awaiter>{std::forward<A>(a).operator co_await(), mArena};
+        } else {
+            return ArenaAwaiter<A &&>{std::forward<A>(a), mArena};
+        }
+    }
+
+    // initial_suspend用, 第一次被resume的时候换上自己的arena(根任务的mArena是创建之后才设置的, 所以存指针)
+    struct EnterArena : std::suspend_always {
+        void await_resume() const noexcept {
+            FrameArena::current() = mFrame->mArena;
+        }
+
+        PooledFrame *mFrame;
+    };
+
+    EnterArena enterArena() noexcept {
+        return {{}, this};
+    }
+
+private:
+    // 帧末尾(按指针对齐)放分配它的memory_resource, 空指针表示FramePool
+    static std::size_t tagOffset(std::size_t size) noexcept {
+        return (size + alignof(void *) - 1) & ~(alignof(void *) - 1);
+    }
+
+    static void *allocateWith(std::size_t size, std::pmr::memory_resource *resource) {
+        std::size_t offset = tagOffset(size);
+        std::size_t total = offset + sizeof(resource);
+        void *ptr = resource ? resource->allocate(total, alignof(std::max_align_t)) : FramePool::allocate(total);
+        std::memcpy(static_cast<char *>(ptr) + offset, &resource, sizeof(resource));
+        return ptr;
+    }
+};
+
+}
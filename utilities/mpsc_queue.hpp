@@ -0,0 +1,52 @@
+/**
+ * @file mpsc_queue.hpp
+ * @author qc
+ * @brief 多生产者单消费者的无锁侵入式队列
+ * @details 生产者用一次CAS把节点压到链表头(栈), 消费者一次exchange把整条链表拿走再反转成先进先出
+ *          节点由使用者提供(需要一个 Node *mNext 成员), 队列本身不分配内存
+ *          比如跨线程resume的Awaiter本身就住在协程帧里, 直接拿来当节点, 投递一次零次堆分配
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#pragma once
+
+#include <atomic>
+
+namespace co_async {
+
+template <class Node>
+struct MpscQueue {
+    // 任何线程都可以调用, 返回之前队列是不是空的
+    bool push(Node *node) noexcept {
+        Node *head = mHead.load(std::memory_order_relaxed);
+        do {
+            node->mNext = head;
+        } while (!mHead.compare_exchange_weak(head, node, std::memory_order_seq_cst, std::memory_order_relaxed));
+        return head == nullptr;
+    }
+
+    // 只能由消费者调用, 按push的顺序返回链表头, 用mNext遍历
+    Node *popAll() noexcept {
+        Node *head = mHead.exchange(nullptr, std::memory_order_seq_cst);
+        Node *prev = nullptr;
+        while (head) {
+            Node *next = head->mNext;
+            head->mNext = prev;
+            prev = head;
+            head = next;
+        }
+        return prev;
+    }
+
+    bool empty() const noexcept {
+        return mHead.load(std::memory_order_relaxed) == nullptr;
+    }
+
+private:
+    std::atomic<Node *> mHead{nullptr};
+};
+
+}
@@ -220,62 +220,127 @@ private:
     /*     } */
     /* } */
 
+    // 用子树v替换子树u的位置
+    void transplant(RbNode *u, RbNode *v) noexcept {
+        if (u->parent == nullptr) {
+            root = v;
+        } else if (u == u->parent->left) {
+            u->parent->left = v;
+        } else {
+            u->parent->right = v;
+        }
+        if (v != nullptr) {
+            v->parent = u->parent;
+        }
+    }
+
+    // 删除黑色节点之后的修复, 叶子是nullptr, 所以要单独带着node的父节点
+    void fixErase(RbNode *node, RbNode *parent) noexcept {
+        while (node != root && (node == nullptr || node->color == BLACK)) {
+            if (node == parent->left) {
+                RbNode *sibling = parent->right;
+                if (sibling->color == RED) {
+                    sibling->color = BLACK;
+                    parent->color = RED;
+                    rotateLeft(parent);
+                    sibling = parent->right;
+                }
+                if ((sibling->left == nullptr || sibling->left->color == BLACK) &&
+                    (sibling->right == nullptr || sibling->right->color == BLACK)) {
+                    sibling->color = RED;
+                    node = parent;
+                    parent = node->parent;
+                } else {
+                    if (sibling->right == nullptr || sibling->right->color == BLACK) {
+                        sibling->left->color = BLACK;
+                        sibling->color = RED;
+                        rotateRight(sibling);
+                        sibling = parent->right;
+                    }
+                    sibling->color = parent->color;
+                    parent->color = BLACK;
+                    if (sibling->right != nullptr) {
+                        sibling->right->color = BLACK;
+                    }
+                    rotateLeft(parent);
+                    node = root;
+                }
+            } else {
+                RbNode *sibling = parent->left;
+                if (sibling->color == RED) {
+                    sibling->color = BLACK;
+                    parent->color = RED;
+                    rotateRight(parent);
+                    sibling = parent->left;
+                }
+                if ((sibling->left == nullptr || sibling->left->color == BLACK) &&
+                    (sibling->right == nullptr || sibling->right->color == BLACK)) {
+                    sibling->color = RED;
+                    node = parent;
+                    parent = node->parent;
+                } else {
+                    if (sibling->left == nullptr || sibling->left->color == BLACK) {
+                        sibling->right->color = BLACK;
+                        sibling->color = RED;
+                        rotateLeft(sibling);
+                        sibling = parent->left;
+                    }
+                    sibling->color = parent->color;
+                    parent->color = BLACK;
+                    if (sibling->left != nullptr) {
+                        sibling->left->color = BLACK;
+                    }
+                    rotateRight(parent);
+                    node = root;
+                }
+            }
+        }
+        if (node != nullptr) {
+            node->color = BLACK;
+        }
+    }
+
     void doErase(RbNode *current) noexcept {
         current->tree = nullptr;
 
-        RbNode *node = nullptr;
         RbNode *child = nullptr;
-        RbColor color = RED;
-
-        if (current->left != nullptr && current->right != nullptr) {
-            RbNode *replace = current;
-            replace = replace->right;
+        RbNode *childParent = nullptr;
+        RbColor color = current->color;
+
+        if (current->left == nullptr) {
+            child = current->right;
+            childParent = current->parent;
+            transplant(current, current->right);
+        } else if (current->right == nullptr) {
+            child = current->left;
+            childParent = current->parent;
+            transplant(current, current->left);
+        } else {
+            // 两个孩子都有: 用右子树里最小的节点顶替current的位置
+            RbNode *replace = current->right;
             while (replace->left != nullptr) {
                 replace = replace->left;
             }
-
-            if (current != replace->parent) {
-                current->parent->left = replace->right;
-                replace->right = current->right;
-                current->right->parent = replace;
-            } else {
-                replace->parent = current;
-            }
-
-            if (current == root) {
-                root = replace;
-            } else if (current->parent->left == current) {
-                current->parent->left = replace;
+            color = replace->color;
+            child = replace->right;
+            if (replace->parent == current) {
+                childParent = replace;
             } else {
-                current->parent->right = replace;
+                childParent = replace->parent;
+                transplant(replace, replace->right);
+                replace->right = current->right;
+                replace->right->parent = replace;
             }
-
+            transplant(current, replace);
             replace->left = current->left;
-            current->left->parent = replace;
-
-            node = replace;
-            color = node->color;
-            child = node->right;
-        } else {
-            node = current;
-            color = node->color;
-            child = (node->left != nullptr) ? node->left : node->right;
-        }
-
-        if (child != nullptr) {
-            child->parent = node->parent;
+            replace->left->parent = replace;
+            replace->color = current->color;
         }
 
-        if (node == root) {
-            root = child;
-        } else if (node->parent->left == node) {
-            node->parent->left = child;
-        } else {
-            node->parent->right = child;
-        }
+        current->left = current->right = current->parent = nullptr;
 
-        if (color == BLACK && root) {
-            fixViolation(child ? child : node->parent);
+        if (color == BLACK && root != nullptr) {
+            fixErase(child, childParent);
         }
     }
 
@@ -329,6 +394,11 @@ public:
         return root == nullptr;
     }
 
+    // value现在是不是挂在这棵树上(不在树上的节点不能erase)
+    bool contains(Value const &value) const noexcept {
+        return static_cast<RbNode const &>(value).tree == this;
+    }
+
     Value &front() const noexcept {
         return static_cast<Value &>(*getFront());
     }
@@ -337,6 +407,22 @@ public:
         return static_cast<Value &>(*getBack());
     }
 
+    // 中序遍历的下一个节点, value是最后一个就返回nullptr
+    Value *next(Value &value) const noexcept {
+        RbNode *current = &static_cast<RbNode &>(value);
+        if (current->right != nullptr) {
+            current = current->right;
+            while (current->left != nullptr) {
+                current = current->left;
+            }
+            return static_cast<Value *>(current);
+        }
+        while (current->parent != nullptr && current == current->parent->right) {
+            current = current->parent;
+        }
+        return static_cast<Value *>(current->parent);
+    }
+
     template <class Visitor>
     void traversalInorder(Visitor &&visitor) {
         doTraversalInorder(root, std::forward<Visitor>(visitor));